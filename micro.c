@@ -8,27 +8,44 @@
 #include <errno.h>
 #include <syslog.h>
 #include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
 #include "micro.h"
+#include "micro_sock.h"
+#include "micro_shm.h"
+#include "micro_capture.h"
+#include "micro_predict.h"
+#include "micro_sched.h"
+#include "micro_metrics.h"
+#include "micro_stats.h"
+#include "micro_shutdown.h"
+#include "micro_rt.h"
+#include "micro_trace.h"
+#include "micro_worker.h"
+#include "micro_filter.h"
+#include "micro_energy.h"
+#include "micro_notify.h"
 
 #define MIN_CHARGE_MV 3680
-#define MAX_CHARGE_MV 4800
+#define MAX_CHARGE_MV MICRO_SCAPS_FULL_MV
 
-static int micro_chip_addr;
+static const micro_transport_t *micro_transport = &micro_i2c_transport;
 
-bool read_power_fail_status(struct gpiod_line *line, board_t *board);
-struct gpiod_chip *init_power_fail_gpio(board_t *board, struct gpiod_line **line, const char *consumer_name);
+bool read_power_fail_status(struct gpiod_line *line, board_t *board, const micro_snapshot_t *snap);
+struct gpiod_chip *init_power_fail_gpio(board_t *board, struct gpiod_line **line, const char *consumer_name,
+				       int request_type);
 
-int micro_init(int i2cbus, int i2caddr)
+static int micro_i2c_open(int i2cbus, int i2caddr)
 {
-	static int fd = -1;
 	char i2c_bus_path[20];
-
-	if (fd != -1)
-		return fd;
+	int fd;
 
 	snprintf(i2c_bus_path, sizeof(i2c_bus_path), "/dev/i2c-%d", i2cbus);
 	fd = open(i2c_bus_path, O_RDWR);
@@ -46,45 +63,181 @@ int micro_init(int i2cbus, int i2caddr)
 		exit(1);
 	}
 
-	micro_chip_addr = i2caddr;
-
 	return fd;
 }
 
-int micro_read(int i2cfd, uint16_t addr, void *data, size_t size)
+static int micro_i2c_transfer(int fd, struct i2c_msg *msgs, int nmsgs)
 {
 	struct i2c_rdwr_ioctl_data packets;
-	struct i2c_msg msgs[2];
-	uint16_t swap_addr;
 
-	swap_addr = addr >> 8;
-	swap_addr |= (addr & 0xff) << 8;
+	packets.msgs = msgs;
+	packets.nmsgs = nmsgs;
 
-	msgs[0].addr = micro_chip_addr;
-	msgs[0].flags = 0;
-	msgs[0].len = 2;
-	msgs[0].buf = (uint8_t *)&swap_addr;
+	return ioctl(fd, I2C_RDWR, &packets);
+}
 
-	msgs[1].addr = micro_chip_addr;
-	msgs[1].flags = I2C_M_RD;
-	msgs[1].len = size;
-	msgs[1].buf = (uint8_t *)data;
+const micro_transport_t micro_i2c_transport = {
+	.name = "i2c-dev",
+	.open = micro_i2c_open,
+	.transfer = micro_i2c_transfer,
+};
+
+/* A busy or briefly unresponsive micro is worth another try before giving up */
+#define MICRO_XFER_RETRIES 2
+
+/* A write payload may already have reached the micro when a transfer times
+ * out or is NAKed partway, and a command such as MICRO_CMD must not run
+ * twice. Transactions that write more than a register address are therefore
+ * only retried when the bus was busy or the address was not acknowledged, so
+ * nothing can have been written.
+ */
+static bool micro_xfer_transient(const struct i2c_msg *msgs, int nmsgs, int err)
+{
+	for (int i = 0; i < nmsgs; i++) {
+		if (!(msgs[i].flags & I2C_M_RD) && msgs[i].len > 2)
+			return err == EAGAIN || err == ENXIO;
+	}
+	return err == EAGAIN || err == ETIMEDOUT || err == EREMOTEIO || err == ENXIO;
+}
 
-	packets.msgs = msgs;
-	packets.nmsgs = 2;
+/* CLOCK_MONOTONIC in ns, the clock every interval and timestamp is kept in */
+uint64_t micro_monotonic_ns(void)
+{
+	struct timespec ts;
 
-	if (ioctl(i2cfd, I2C_RDWR, &packets) < 0) {
-		perror("Failed to read from supervisory micro");
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* All bus traffic goes through here, so this is the one place transactions
+ * are retried and instrumented.
+ */
+static int micro_transfer(micro_dev_t *dev, struct i2c_msg *msgs, int nmsgs)
+{
+	uint64_t start_ns = 0;
+	int retries = 0;
+	int ret;
+
+	if (micro_stats_enabled)
+		start_ns = micro_monotonic_ns();
+
+	while ((ret = dev->transport->transfer(dev->fd, msgs, nmsgs)) < 0 && retries < MICRO_XFER_RETRIES &&
+	       micro_xfer_transient(msgs, nmsgs, errno))
+		retries++;
+
+	if (micro_stats_enabled) {
+		int err = errno;
+
+		micro_stats_record(msgs, nmsgs, start_ns, retries, ret < 0);
+		errno = err;
+	}
+
+	return ret;
+}
+
+/* Transport used by every micro_open() from here on */
+void micro_set_transport(const micro_transport_t *transport)
+{
+	micro_transport = transport;
+}
+
+micro_dev_t *micro_open(int i2cbus, int i2caddr)
+{
+	micro_dev_t *dev;
+
+	dev = malloc(sizeof(*dev));
+	if (dev == NULL) {
+		perror("Failed to allocate supervisor");
 		exit(1);
 	}
-	return 0;
+
+	dev->transport = micro_transport;
+	dev->fd = dev->transport->open(i2cbus, i2caddr);
+	dev->i2cbus = i2cbus;
+	dev->i2caddr = i2caddr;
+
+	return dev;
 }
 
-int micro_write(int i2cfd, uint16_t addr, const void *data, size_t size)
+void micro_close(micro_dev_t *dev)
 {
-	struct i2c_rdwr_ioctl_data packets;
-	struct i2c_msg msg;
-	uint8_t outdata[4096];
+	close(dev->fd);
+	free(dev);
+}
+
+/* Serializes one-shot bus users (tsmicroctl invocations that cannot hand
+ * their work to a running daemon) against each other. Returns -1 if the lock
+ * file cannot be opened, e.g. /run is unavailable late in shutdown; the caller
+ * then carries on unlocked.
+ */
+int micro_bus_lock(int i2cbus)
+{
+	char lock_path[48];
+	int fd;
+
+	snprintf(lock_path, sizeof(lock_path), "/run/tsmicroctl-i2c-%d.lock", i2cbus);
+	fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return -1;
+
+	while (flock(fd, LOCK_EX) < 0) {
+		if (errno != EINTR) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+void micro_bus_unlock(int lockfd)
+{
+	if (lockfd != -1)
+		close(lockfd);
+}
+
+void micro_xfer_init(micro_xfer_t *xfer)
+{
+	xfer->nops = 0;
+	xfer->used = 0;
+}
+
+static uint8_t *micro_xfer_reserve(micro_xfer_t *xfer, size_t size)
+{
+	uint8_t *buf = &xfer->buf[xfer->used];
+
+	assert(xfer->used + size <= sizeof(xfer->buf));
+	xfer->used += size;
+
+	return buf;
+}
+
+static micro_xfer_op_t *micro_xfer_op(micro_xfer_t *xfer, uint16_t addr, size_t size, size_t buf_size)
+{
+	micro_xfer_op_t *op;
+
+	assert(xfer->nops < MICRO_XFER_MAX_OPS);
+	op = &xfer->ops[xfer->nops++];
+	op->addr = addr;
+	op->len = size;
+	op->buf = micro_xfer_reserve(xfer, buf_size);
+	op->buf[0] = ((addr >> 8) & 0xff);
+	op->buf[1] = (addr & 0xff);
+
+	return op;
+}
+
+void micro_xfer_read(micro_xfer_t *xfer, uint16_t addr, void *data, size_t size)
+{
+	micro_xfer_op_t *op = micro_xfer_op(xfer, addr, size, 2);
+
+	op->read = 1;
+	op->data = data;
+}
+
+void micro_xfer_write(micro_xfer_t *xfer, uint16_t addr, const void *data, size_t size)
+{
+	micro_xfer_op_t *op;
 
 	/* The max size of 4k is not arbitrary, but may no longer be a limitation
 	 * in the future. In older implementations, it was found that 4k was the
@@ -96,36 +249,131 @@ int micro_write(int i2cfd, uint16_t addr, const void *data, size_t size)
 	 */
 	assert(size <= 4094);
 
-	outdata[0] = ((addr >> 8) & 0xff);
-	outdata[1] = (addr & 0xff);
-	memcpy(&outdata[2], data, size);
+	/* The previous write's data is still at the end of buf, so a write
+	 * continuing from it only has to be appended.
+	 */
+	if (xfer->nops > 0) {
+		op = &xfer->ops[xfer->nops - 1];
+		if (!op->read && op->addr + op->len == addr && op->len + size <= 4094) {
+			memcpy(micro_xfer_reserve(xfer, size), data, size);
+			op->len += size;
+			return;
+		}
+	}
+
+	op = micro_xfer_op(xfer, addr, size, 2 + size);
+	op->read = 0;
+	op->data = NULL;
+	memcpy(&op->buf[2], data, size);
+}
+
+int micro_xfer_submit(micro_dev_t *dev, micro_xfer_t *xfer)
+{
+	struct i2c_msg msgs[2 * MICRO_XFER_MAX_OPS];
+	int nmsgs = 0;
+
+	for (int i = 0; i < xfer->nops; i++) {
+		micro_xfer_op_t *op = &xfer->ops[i];
+
+		msgs[nmsgs].addr = dev->i2caddr;
+		msgs[nmsgs].flags = 0;
+		msgs[nmsgs].len = op->read ? 2 : 2 + op->len;
+		msgs[nmsgs].buf = op->buf;
+		nmsgs++;
+
+		if (op->read) {
+			msgs[nmsgs].addr = dev->i2caddr;
+			msgs[nmsgs].flags = I2C_M_RD;
+			msgs[nmsgs].len = op->len;
+			msgs[nmsgs].buf = op->data;
+			nmsgs++;
+		}
+	}
+
+	return micro_transfer(dev, msgs, nmsgs);
+}
+
+/* Like micro_read(), but a failed transfer returns -1 with errno set rather
+ * than exiting, for the daemon's reads that must ride out a bad one.
+ */
+int micro_try_read(micro_dev_t *dev, uint16_t addr, void *data, size_t size)
+{
+	micro_xfer_t xfer;
+
+	micro_xfer_init(&xfer);
+	micro_xfer_read(&xfer, addr, data, size);
 
-	msg.addr = micro_chip_addr;
-	msg.flags = 0;
-	msg.len = 2 + size;
-	msg.buf = outdata;
+	return micro_xfer_submit(dev, &xfer) < 0 ? -1 : 0;
+}
+
+int micro_read(micro_dev_t *dev, uint16_t addr, void *data, size_t size)
+{
+	if (micro_try_read(dev, addr, data, size) < 0) {
+		perror("Failed to read from supervisory micro");
+		exit(1);
+	}
+	return 0;
+}
+
+/* micro_write() that returns -1 with errno set instead of exiting */
+int micro_try_write(micro_dev_t *dev, uint16_t addr, const void *data, size_t size)
+{
+	micro_xfer_t xfer;
 
-	packets.msgs = &msg;
-	packets.nmsgs = 1;
+	micro_xfer_init(&xfer);
+	micro_xfer_write(&xfer, addr, data, size);
 
-	if (ioctl(i2cfd, I2C_RDWR, &packets) < 0) {
+	return micro_xfer_submit(dev, &xfer) < 0 ? -1 : 0;
+}
+
+int micro_write(micro_dev_t *dev, uint16_t addr, const void *data, size_t size)
+{
+	if (micro_try_write(dev, addr, data, size) < 0) {
 		perror("Failed to write to supervisory micro");
 		exit(1);
 	}
 	return 0;
 }
 
-uint8_t micro_scaps_remaining_pct(int i2cfd, board_t *board)
+/* Everything but the status flags byte pair is a big-endian 16-bit value */
+static void micro_snapshot_swap(micro_snapshot_t *snap)
 {
-	uint16_t current_voltage;
-	uint32_t voltage_range, normalized_voltage;
-	uint8_t remaining_percentage;
+	uint16_t *words = (uint16_t *)snap;
 
-	// Read the current supercap voltage
-	if (micro_read16_swap(i2cfd, MICRO_ADC_8, &current_voltage) < 0) {
-		perror("Failed to read current supercap voltage");
-		exit(EXIT_FAILURE);
+	for (int i = 0; i < sizeof(*snap) / sizeof(uint16_t); i++) {
+		if (i != MICRO_STATUS_FLAGS / 2)
+			words[i] = swap_endian16(words[i]);
 	}
+}
+
+/* Reads every register from MICRO_ADC_0 up in one transfer. Returns -1 with
+ * errno set if it fails.
+ */
+int micro_read_snapshot(micro_dev_t *dev, micro_snapshot_t *snap)
+{
+	int result;
+
+	_Static_assert(sizeof(micro_snapshot_t) == MICRO_CHARGE_CURRENT + 2, "snapshot must match the register map");
+
+	result = micro_try_read(dev, MICRO_ADC_0, snap, sizeof(*snap));
+	if (result < 0)
+		return result;
+
+	micro_snapshot_swap(snap);
+
+	return result;
+}
+
+uint8_t micro_scaps_remaining_pct(const micro_snapshot_t *snap)
+{
+	return micro_scaps_mv_pct(snap->adc[MICRO_ADC_CHANNEL(MICRO_ADC_8)]);
+}
+
+/* Charge percentage of a supercap voltage, e.g. one from micro_filter_sample() */
+uint8_t micro_scaps_mv_pct(uint16_t current_voltage)
+{
+	uint32_t voltage_range, normalized_voltage;
+	uint8_t remaining_percentage;
 
 	// Calculate remaining percentage
 	if (current_voltage <= MIN_CHARGE_MV) {
@@ -149,6 +397,12 @@ uint8_t micro_scaps_remaining_pct(int i2cfd, board_t *board)
 	return remaining_percentage;
 }
 
+/* Lowest voltage that micro_scaps_remaining_pct() still reports as pct */
+static uint16_t scaps_pct_mv(uint8_t pct)
+{
+	return MIN_CHARGE_MV + (uint32_t)pct * (MAX_CHARGE_MV - MIN_CHARGE_MV) / 100;
+}
+
 uint16_t swap_endian16(uint16_t value)
 {
 	return (value << 8) | (value >> 8);
@@ -160,150 +414,177 @@ uint32_t swap_endian32(uint32_t value)
 	       ((value << 24) & 0xFF000000);
 }
 
-int micro_read16_swap(int fd, int addr, uint16_t *data)
+int micro_read16_swap(micro_dev_t *dev, int addr, uint16_t *data)
 {
-	int result = micro_read(fd, addr, (uint16_t *)data, sizeof(uint16_t));
+	int result = micro_read(dev, addr, (uint16_t *)data, sizeof(uint16_t));
 	if (result >= 0)
 		*data = swap_endian16(*data);
 	return result;
 }
 
-int micro_write16_swap(int fd, int addr, uint16_t *data)
+int micro_try_read16_swap(micro_dev_t *dev, int addr, uint16_t *data)
+{
+	int result = micro_try_read(dev, addr, (uint16_t *)data, sizeof(uint16_t));
+	if (result >= 0)
+		*data = swap_endian16(*data);
+	return result;
+}
+
+int micro_write16_swap(micro_dev_t *dev, int addr, uint16_t *data)
 {
 	uint16_t temp = swap_endian16(*data);
-	return micro_write(fd, addr, &temp, sizeof(uint16_t));
+	return micro_write(dev, addr, &temp, sizeof(uint16_t));
 }
 
 // Read/Write 32-bit data with endianness swap
-int micro_read32_swap(int fd, int addr, uint32_t *data)
+int micro_read32_swap(micro_dev_t *dev, int addr, uint32_t *data)
 {
-	int result = micro_read(fd, addr, (uint32_t *)data, sizeof(uint32_t));
+	int result = micro_read(dev, addr, (uint32_t *)data, sizeof(uint32_t));
 	if (result >= 0)
 		*data = swap_endian32(*data);
 	return result;
 }
 
-int micro_write32_swap(int fd, int addr, uint32_t *data)
+int micro_write32_swap(micro_dev_t *dev, int addr, uint32_t *data)
 {
 	uint32_t temp = swap_endian32(*data);
-	return micro_write(fd, addr, &temp, sizeof(uint32_t));
+	return micro_write(dev, addr, &temp, sizeof(uint32_t));
 }
 
-void micro_generic_info(int i2cfd, board_t *board)
+int micro_read_info(micro_dev_t *dev, micro_info_t *info)
 {
-	uint16_t temp, startup_temp;
-	uint16_t charge_current;
-	uint8_t status_flags;
-	uint8_t revision;
-	char build[80];
+	micro_xfer_t xfer;
 
-	if (micro_read8(i2cfd, MICRO_REVISION, &revision) < 0) {
-		perror("Failed to read microcontroller version");
-		exit(1);
-	}
-	printf("micro_revision=%d\n", revision);
-
-	if (micro_read(i2cfd, MICRO_BUILD_STRING, build, sizeof(build)) < 0) {
-		perror("Failed to read microcontroller build info");
-		exit(1);
-	}
-	printf("micro_build=\"%s\"\n", build);
-
-	if (micro_read16_swap(i2cfd, MICRO_ADC_4, &startup_temp) < 0) {
-		perror("Failed to read startup temperature");
-		exit(1);
-	}
-	printf("micro_startup_celcius=%d\n", startup_temp);
+	micro_xfer_init(&xfer);
+	micro_xfer_read(&xfer, MICRO_REVISION, &info->revision, sizeof(info->revision));
+	micro_xfer_read(&xfer, MICRO_BUILD_STRING, info->build, sizeof(info->build));
+	micro_xfer_read(&xfer, MICRO_ADC_0, &info->snap, sizeof(info->snap));
 
-	if (micro_read16_swap(i2cfd, MICRO_ADC_10, &temp) < 0) {
-		perror("Failed to read current temperature");
-		exit(1);
+	if (micro_xfer_submit(dev, &xfer) < 0) {
+		perror("Failed to read supervisor registers");
+		return -1;
 	}
-	printf("micro_celcius=%d\n", temp);
 
-	if (micro_read8(i2cfd, MICRO_STATUS_FLAGS, &status_flags) < 0) {
-		perror("Failed to read status flags");
-		exit(1);
-	}
-	printf("usb_present=%d\n", !!(status_flags & MICRO_STATUS_FLAGS_USB_PRESENT));
+	info->build[sizeof(info->build) - 1] = '\0';
+	micro_snapshot_swap(&info->snap);
 
-	if (!board->has_silo)
-		return;
+	return 0;
+}
 
-	printf("power_fail=%d\n", !!(status_flags & MICRO_STATUS_FLAGS_POWER_FAIL));
-	printf("scaps_enabled=%d\n", !!(status_flags & MICRO_STATUS_FLAGS_SCAPS_EN));
-	printf("scaps_met_min=%d\n", !!(status_flags & MICRO_STATUS_FLAGS_SCAPS_MET_MIN));
-	printf("scaps_charging=%d\n", !!(status_flags & MICRO_STATUS_FLAGS_SCAPS_CHARGING));
-	printf("supercaps_remaining_pct=%d\n", micro_scaps_remaining_pct(i2cfd, board));
+/* Converts every channel in the board's table in one pass. The raw readings
+ * are at most 16 bits and the scales 32, so the 64-bit product cannot
+ * overflow and neither can the result once shifted back down.
+ */
+void micro_adc_convert(const board_t *board, const micro_snapshot_t *snap, uint32_t *values)
+{
+	for (int i = 0; i < board->adc_nchannels; i++) {
+		const micro_adc_channel_t *channel = &board->adc_channels[i];
+		uint64_t raw = snap->adc[MICRO_ADC_CHANNEL(channel->reg)];
 
-	if (micro_read16_swap(i2cfd, MICRO_CHARGE_CURRENT, &charge_current) < 0) {
-		perror("Failed to read Supercaps charge current");
-		exit(1);
+		values[i] = (raw * channel->scale + (1U << (MICRO_ADC_SCALE_SHIFT - 1))) >> MICRO_ADC_SCALE_SHIFT;
 	}
-	printf("supercaps_charge_current_ma=%d\n", charge_current);
+}
 
-	if (micro_read16_swap(i2cfd, MICRO_CHARGE_CURRENT_DEFAULT, &charge_current) < 0) {
-		perror("Failed to read Supercaps charge current default");
-		exit(1);
+void micro_generic_info(board_t *board, const micro_info_t *info, FILE *out)
+{
+	const micro_snapshot_t *snap = &info->snap;
+	uint32_t values[MICRO_ADC_MAX_CHANNELS];
+	micro_energy_t energy;
+
+	fprintf(out, "micro_revision=%d\n", info->revision);
+	fprintf(out, "micro_build=\"%s\"\n", info->build);
+
+	fprintf(out, "micro_startup_celcius=%d\n", snap->adc[MICRO_ADC_CHANNEL(MICRO_ADC_4)]);
+	fprintf(out, "micro_celcius=%d\n", snap->adc[MICRO_ADC_CHANNEL(MICRO_ADC_10)]);
+	fprintf(out, "usb_present=%d\n", !!(snap->status_flags & MICRO_STATUS_FLAGS_USB_PRESENT));
+
+	if (board->has_silo) {
+		fprintf(out, "power_fail=%d\n", !!(snap->status_flags & MICRO_STATUS_FLAGS_POWER_FAIL));
+		fprintf(out, "scaps_enabled=%d\n", !!(snap->status_flags & MICRO_STATUS_FLAGS_SCAPS_EN));
+		fprintf(out, "scaps_met_min=%d\n", !!(snap->status_flags & MICRO_STATUS_FLAGS_SCAPS_MET_MIN));
+		fprintf(out, "scaps_charging=%d\n", !!(snap->status_flags & MICRO_STATUS_FLAGS_SCAPS_CHARGING));
+		fprintf(out, "supercaps_remaining_pct=%d\n", micro_scaps_remaining_pct(snap));
+		if (micro_energy_init(&energy, board) == 0) {
+			uint16_t mv = snap->adc[MICRO_ADC_CHANNEL(MICRO_ADC_8)];
+
+			fprintf(out, "supercaps_energy_mj=%u\n", micro_energy_mj(&energy, mv));
+			fprintf(out, "supercaps_energy_pct=%d\n", micro_energy_pct(&energy, mv));
+		}
+		fprintf(out, "supercaps_charge_current_ma=%d\n", snap->charge_current);
+		fprintf(out, "supercaps_charge_current_default_ma=%d\n", snap->charge_current_default);
 	}
-	printf("supercaps_charge_current_default_ma=%d\n", charge_current);
-}
 
-#define MAX_SLEEP_SECONDS (UINT32_MAX / 1000) 
+	assert(board->adc_nchannels <= MICRO_ADC_MAX_CHANNELS);
+	micro_adc_convert(board, snap, values);
+	for (int i = 0; i < board->adc_nchannels; i++)
+		fprintf(out, "%s=%u\n", board->adc_channels[i].name, values[i]);
+}
 
-void micro_sleep(int i2cfd, board_t *board, uint32_t seconds)
+void micro_sleep(micro_dev_t *dev, board_t *board, uint32_t seconds)
 {
 	uint8_t buf[5];
-	uint32_t ms;
 
 	// Check if the input seconds are within the valid range
-	if (seconds > MAX_SLEEP_SECONDS) {
+	if (seconds > MICRO_SLEEP_MAX_SECONDS) {
 		fprintf(stderr, "Error: Invalid sleep duration. Please specify between 0 and %u seconds.\n",
-			MAX_SLEEP_SECONDS);
+			MICRO_SLEEP_MAX_SECONDS);
 		exit(EXIT_FAILURE);
 	}
 
-	ms = seconds * 1000;
-	if (ms % 10)
-		ms = (ms / 10) + 1;
-	else
-		ms = ms / 10;
+	micro_sleep_cmd(buf, seconds);
 
-	buf[0] = ms & 0xff;
-	buf[1] = (ms >> 8) & 0xff;
-	buf[2] = (ms >> 16) & 0xff;
-	buf[3] = (ms >> 24) & 0xff;
-	buf[4] = MICRO_CMD_SLEEP;
-
-	if (micro_write(i2cfd, 1024, buf, sizeof(buf)) < 0) {
+	if (micro_write(dev, MICRO_CMD, buf, sizeof(buf)) < 0) {
 		perror("Failed to write sleep command to microcontroller");
 		exit(EXIT_FAILURE);
 	}
 }
 
-void micro_set_charge_current(int i2cfd, board_t *board, uint16_t ma)
+void micro_set_charge_current(micro_dev_t *dev, board_t *board, uint16_t ma)
 {
+	micro_xfer_t xfer;
+
 	assert(ma >= board->min_current);
 	assert(ma <= board->max_current);
-	/* Write both the current and persistent charge rate */
-	micro_write16_swap(i2cfd, MICRO_CHARGE_CURRENT_DEFAULT, &ma);
-	micro_write16_swap(i2cfd, MICRO_CHARGE_CURRENT, &ma);
+	ma = swap_endian16(ma);
+
+	/* Write both the current and persistent charge rate, the registers are
+	 * adjacent so this goes out as a single message.
+	 */
+	micro_xfer_init(&xfer);
+	micro_xfer_write(&xfer, MICRO_CHARGE_CURRENT_DEFAULT, &ma, sizeof(ma));
+	micro_xfer_write(&xfer, MICRO_CHARGE_CURRENT, &ma, sizeof(ma));
+
+	if (micro_xfer_submit(dev, &xfer) < 0) {
+		perror("Failed to write charge current to microcontroller");
+		exit(1);
+	}
 }
 
-void micro_scaps_en(int i2cfd, board_t *board, int en)
+void micro_scaps_en(micro_dev_t *dev, board_t *board, int en)
 {
 	uint8_t value;
 
-	micro_read8(i2cfd, MICRO_STATUS_FLAGS, &value);
+	micro_read8(dev, MICRO_STATUS_FLAGS, &value);
 	value &= ~6;
 	if (en)
 		value |= MICRO_STATUS_FLAGS_SCAPS_EN;
-	micro_write8(i2cfd, MICRO_STATUS_FLAGS, &value);
+	micro_write8(dev, MICRO_STATUS_FLAGS, &value);
 }
 
-struct gpiod_chip *init_power_fail_gpio(board_t *board, struct gpiod_line **line, const char *consumer_name)
+/* Boards without a power_fail_bank (or a simulated micro) have no power_fail#
+ * GPIO; *line is set to NULL and the micro's status flags are used instead.
+ */
+struct gpiod_chip *init_power_fail_gpio(board_t *board, struct gpiod_line **line, const char *consumer_name,
+				       int request_type)
 {
-	struct gpiod_chip *chip = gpiod_chip_open_by_label(board->power_fail_bank);
+	struct gpiod_chip *chip;
+
+	if (board->power_fail_bank == NULL) {
+		*line = NULL;
+		return NULL;
+	}
+
+	chip = gpiod_chip_open_by_label(board->power_fail_bank);
 	if (!chip) {
 		perror("Failed to open GPIO chip by label");
 		exit(1);
@@ -318,11 +599,11 @@ struct gpiod_chip *init_power_fail_gpio(board_t *board, struct gpiod_line **line
 
 	struct gpiod_line_request_config config = {
 		.consumer = consumer_name,
-		.request_type = GPIOD_LINE_REQUEST_DIRECTION_INPUT
+		.request_type = request_type
 	};
 
 	if (gpiod_line_request(*line, &config, 0) < 0) {
-		perror("Failed to request GPIO line as input");
+		perror("Failed to request GPIO line");
 		gpiod_chip_close(chip);
 		exit(1);
 	}
@@ -330,9 +611,14 @@ struct gpiod_chip *init_power_fail_gpio(board_t *board, struct gpiod_line **line
 	return chip; // Return the opened GPIO chip for later cleanup
 }
 
-bool read_power_fail_status(struct gpiod_line *line, board_t *board)
+bool read_power_fail_status(struct gpiod_line *line, board_t *board, const micro_snapshot_t *snap)
 {
-	int value = gpiod_line_get_value(line);
+	int value;
+
+	if (line == NULL)
+		return !!(snap->status_flags & MICRO_STATUS_FLAGS_POWER_FAIL);
+
+	value = gpiod_line_get_value(line);
 	if (value < 0) {
 		perror("Failed to read GPIO value");
 		exit(1);
@@ -340,127 +626,1006 @@ bool read_power_fail_status(struct gpiod_line *line, board_t *board)
 	return (value == board->power_fail_active);
 }
 
-// Blocks until charge is above `block_pct` and power fail is cleared
-void micro_scaps_block_pct(int i2cfd, board_t *board, int block_pct)
+/* Takes a fresh register snapshot and returns the supercap charge from it */
+uint8_t micro_scaps_sample_pct(micro_dev_t *dev, micro_snapshot_t *snap)
+{
+	if (micro_read_snapshot(dev, snap) < 0) {
+		perror("Failed to read supervisor registers");
+		exit(1);
+	}
+	return micro_scaps_remaining_pct(snap);
+}
+
+/* --wait-pct samples at least this often near the crossing, and at most this
+ * far apart while it is still a long way off.
+ */
+#define WAIT_MIN_MS 250
+#define WAIT_MAX_MS 10000
+
+/* Blocks until charge is above block_pct and power fail is cleared.
+ *
+ * Charging is constant current, so the supercap voltage rises in a straight
+ * line. Rather than polling, each sleep covers half of the time the slope
+ * so far predicts is left, so the samples close in on the crossing and the
+ * bus is left alone while the target is still a long way off. With a filter,
+ * the charge is judged on the filtered voltage.
+ */
+void micro_scaps_block_pct(micro_dev_t *dev, board_t *board, int block_pct, micro_filter_t *filter)
 {
 	uint8_t cur_pct;
+	uint16_t mv;
+	micro_snapshot_t snap;
+	micro_sched_t sched;
 	struct gpiod_chip *chip;
 	struct gpiod_line *line;
 	bool charge_ok, power_fail_clear;
-	int counter = 0;
+	uint64_t now_ns, printed_ns = 0;
+	uint16_t target_mv;
+	int64_t eta_ms, sleep_ms;
 
 	assert(block_pct <= 100);
+	target_mv = scaps_pct_mv(block_pct);
 
-	micro_scaps_en(i2cfd, board, 1);
-	chip = init_power_fail_gpio(board, &line, "micro_scaps_block_pct");
+	micro_scaps_en(dev, board, 1);
+	chip = init_power_fail_gpio(board, &line, "micro_scaps_block_pct", GPIOD_LINE_REQUEST_DIRECTION_INPUT);
+	micro_sched_init(&sched, WAIT_MIN_MS, WAIT_MAX_MS);
 
 	while (true) {
-		cur_pct = micro_scaps_remaining_pct(i2cfd, board);
-		power_fail_clear = !read_power_fail_status(line, board);
+		cur_pct = micro_scaps_sample_pct(dev, &snap);
+		mv = snap.adc[MICRO_ADC_CHANNEL(MICRO_ADC_8)];
+		if (filter) {
+			mv = micro_filter_sample(filter, dev, mv);
+			cur_pct = micro_scaps_mv_pct(mv);
+		}
+		now_ns = micro_monotonic_ns();
+		power_fail_clear = !read_power_fail_status(line, board, &snap);
 		charge_ok = (cur_pct >= block_pct);
 
-		// Print status once per second
-		if (counter % 10 == 0) {
-			printf("Supercap Charge: %d%% (Target: %d%%) | Power Fail: %s\n",
-			       cur_pct, block_pct, power_fail_clear ? "No" : "YES");
+		/* Nothing charges while power is out, so start the slope over */
+		if (power_fail_clear)
+			micro_sched_add(&sched, now_ns / 1000000, mv);
+		else
+			micro_sched_reset(&sched);
+		eta_ms = micro_sched_ms_to(&sched, target_mv);
+
+		// Print status at most once per second
+		if ((charge_ok && power_fail_clear) || now_ns - printed_ns >= 1000000000ULL) {
+			printf("Supercap Charge: %d%% (Target: %d%%) | Power Fail: %s", cur_pct, block_pct,
+			       power_fail_clear ? "No" : "YES");
+			if (!charge_ok && eta_ms >= 0)
+				printf(" | ETA: %llds", (long long)(eta_ms + 999) / 1000);
+			printf("\n");
 			fflush(stdout);
+			printed_ns = now_ns;
 		}
 
 		if (charge_ok && power_fail_clear) {
 			break;
 		}
 
-		usleep(1000 * 100);
-		counter++;
+		if (eta_ms < 0)
+			sleep_ms = WAIT_MIN_MS;
+		else if (eta_ms / 2 < WAIT_MIN_MS)
+			sleep_ms = WAIT_MIN_MS;
+		else if (eta_ms / 2 > WAIT_MAX_MS)
+			sleep_ms = WAIT_MAX_MS;
+		else
+			sleep_ms = eta_ms / 2;
+
+		usleep(1000 * sleep_ms);
 	}
 
-	gpiod_chip_close(chip);
+	if (filter && filter->reads)
+		printf("Filter: %llu extra reads, %.1f ms of bus time\n", (unsigned long long)filter->reads,
+		       filter->bus_ns / 1e6);
+
+	if (chip)
+		gpiod_chip_close(chip);
+}
+
+/* Converts a power_fail# edge event into the asserted/deasserted state */
+static bool power_fail_event_status(struct gpiod_line_event *event, board_t *board)
+{
+	int value = (event->event_type == GPIOD_LINE_EVENT_RISING_EDGE);
+
+	return (value == board->power_fail_active);
 }
 
-// Monitors supercaps and triggers a reboot if charge is too low while power fails
-void micro_scaps_monitor_daemon(int i2cfd, board_t *board, int reboot_pct)
+/* The kernel stamps line events with CLOCK_MONOTONIC since 5.7, and with
+ * CLOCK_REALTIME before that. The event has only just happened, so it was
+ * stamped with whichever clock it is closest to now.
+ */
+static uint64_t power_fail_event_ns(const struct gpiod_line_event *event)
 {
-	uint8_t cur_pct = 0;
-	uint8_t status_flags;
+	uint64_t ts = event->ts.tv_sec * 1000000000ULL + event->ts.tv_nsec;
+	uint64_t mono = micro_monotonic_ns();
+	uint64_t real;
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	real = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	if (llabs((int64_t)(real - ts)) < llabs((int64_t)(mono - ts)))
+		return ts - (real - mono);
+	return ts;
+}
+
+/* Readings are refreshed for socket clients if the daemon's own sampling has
+ * not touched them for this long, e.g. when idle with the supercaps full.
+ */
+#define DAEMON_INFO_MAX_AGE_MS 1000
+
+/* Without power_fail# the status flags have to be polled to notice a power
+ * fail, so sampling never slows down past this.
+ */
+#define DAEMON_POLL_MS 100
+
+/* With --metrics, readings are still refreshed this often once the supercaps
+ * are full, and the file is never rewritten more than once a second.
+ */
+#define DAEMON_METRICS_IDLE_MS 10000
+#define DAEMON_METRICS_MIN_MS 1000
+
+/* The systemd watchdog is pinged at most, and sampled for at least, every
+ * watchdog interval / DAEMON_WATCHDOG_DIV. With both the same, a sample that
+ * lands just before the ping is due is not pinged for, and the next ping
+ * comes two steps later, still well inside the interval.
+ */
+#define DAEMON_WATCHDOG_DIV 4
+
+/* A sample still with the bus worker after this long is counted as timed out.
+ * The loop carries on with the readings it has until the worker gets it back.
+ */
+#define DAEMON_BUS_TIMEOUT_MS 250
+
+/* A failed sample is retried straight away this many times in a row before
+ * waiting for the next tick of the sample timer.
+ */
+#define DAEMON_BUS_RETRIES 3
+
+/* Iterations over opts->loop_budget_us are logged at most this often */
+#define DAEMON_OVERRUN_LOG_MS 1000
+
+/* One supervisor watched by the daemon */
+struct daemon_unit {
+	int index;
+	char name[16];   /* <bus>-<addr>, as Linux names I2C clients */
+	char prefix[20]; /* Log prefix, empty when there is only one supervisor */
+	micro_dev_t *dev;
+	board_t *board;
+	int reboot_pct;
+	uint16_t reboot_mv;
+	bool active; /* Supercaps present and enabled */
+	micro_info_t info;
+	uint64_t sampled_ns;
+	uint16_t scaps_mv; /* Filtered, what decisions are made on */
+	uint8_t cur_pct;
+	micro_filter_t filter; /* The worker's, through sample_req */
+	bool filter_reset;     /* Not yet handed to the worker */
+	uint64_t filter_reads; /* The filter's counters from the latest sample */
+	uint64_t filter_bus_ns;
+	micro_energy_t energy;
+	bool has_energy;
+	uint32_t load_mw;  /* Measured during the latest power fail, 0 if none yet */
+	int64_t holdup_ms; /* Left at the load of the current power fail, -1 if not known */
+	micro_req_t sample_req;
+	micro_req_t capture_req;
+	bool sample_timed_out;
+	int sample_retries;
+	bool event_sampled; /* Sampled since the power fail began */
 	struct gpiod_chip *chip;
 	struct gpiod_line *line;
-	bool current_power_fail = false;
-	bool power_fail_active = false;
-	bool monitor_i2c = true;
-	bool suppress_message = false;
-	int counter = 0;
-	int sleep_time = 100000; // Default sleep: 100ms
-	int print_interval = 10; // Default print every 1s (10 x 100ms)
+	bool power_fail;        /* power_fail# as last seen */
+	bool power_fail_active; /* Power fail being ridden through */
+	micro_shm_page_t *shm;
+	micro_capture_t *cap;
+	bool capturing;
+	micro_predict_t pred;
+	micro_sched_t sched;
+	int64_t empty_ms;
+	int sample_interval; /* 0 while the timer is disarmed */
+	int timerfd;
+	int capture_timerfd;
+	uint64_t logged_ns;
+	uint64_t power_fail_ns;
+	uint64_t edge_ns; /* Kernel timestamp of the last power_fail# assertion, 0 if consumed */
+	uint64_t seen_ns; /* When the daemon read it */
+	micro_trace_event_t *trace_event;
+	micro_metrics_t metrics;
+};
+
+struct daemon {
+	const micro_daemon_opts_t *opts;
+	const micro_supervisor_t *sups;
+	struct daemon_unit units[MICRO_DAEMON_MAX_SUPERVISORS];
+	int nunits;
+	micro_shutdown_t shutdown;
+	uint64_t metrics_ns;
+	bool metrics_failed;
+	micro_latency_t latency;
+	micro_trace_t *trace;
+	micro_worker_t worker;
+	micro_req_t sleep_req; /* The emergency shutdown's micro sleep */
+	uint64_t watchdog_ns; /* systemd watchdog interval, 0 without one */
+	uint64_t watchdog_sent_ns;
+	uint64_t overrun_logged_ns;
+};
+
+/* Makes the latest readings visible to micro_shm_read() users */
+static void daemon_publish(struct daemon_unit *unit)
+{
+	micro_shm_data_t data = { 0 };
 
-	openlog("tsmicroctl", LOG_PID | LOG_CONS, LOG_DAEMON);
+	if (unit->shm == NULL)
+		return;
 
-	assert(reboot_pct <= 100);
+	data.timestamp_ns = unit->sampled_ns;
+	data.scaps_mv = unit->info.snap.adc[MICRO_ADC_CHANNEL(MICRO_ADC_8)];
+	data.scaps_filtered_mv = unit->scaps_mv;
+	data.scaps_pct = unit->cur_pct;
+	data.status_flags = unit->info.snap.status_flags;
+	data.power_fail = unit->power_fail;
+	micro_shm_publish(unit->shm, &data);
+}
 
-	if (micro_read8(i2cfd, MICRO_STATUS_FLAGS, &status_flags) < 0) {
-		syslog(LOG_ERR, "Failed to read status flags: %s", strerror(errno));
-		exit(1);
+/* Hands a sample to the bus worker, unless the last one is still there */
+/* Hands the sample request to the worker. A filter reset rides along with
+ * it, since the filter may only be touched by the worker.
+ */
+static void daemon_submit_sample(struct daemon *daemon, struct daemon_unit *unit)
+{
+	unit->sample_req.filter_reset |= unit->filter_reset;
+	unit->filter_reset = false;
+	micro_worker_submit(&daemon->worker, &unit->sample_req);
+}
+
+static void daemon_sample(struct daemon *daemon, struct daemon_unit *unit)
+{
+	uint64_t pending_ns;
+
+	if (!unit->sample_req.busy) {
+		daemon_submit_sample(daemon, unit);
+		return;
+	}
+
+	pending_ns = micro_monotonic_ns() - unit->sample_req.submit_ns;
+	if (!unit->sample_timed_out && pending_ns > DAEMON_BUS_TIMEOUT_MS * 1000000ULL) {
+		unit->sample_timed_out = true;
+		unit->metrics.bus_timeouts++;
+		micro_rt_log(LOG_WARNING, "%sSupervisor has not answered for %llu ms, carrying on without new readings",
+			     unit->prefix, (unsigned long long)(pending_ns / 1000000));
+	}
+}
+
+/* Pings the systemd watchdog, but only while every supervisor has been
+ * sampled successfully within the watchdog interval, so a hung bus or a
+ * starved daemon gets it restarted.
+ */
+static void daemon_watchdog(struct daemon *daemon)
+{
+	uint64_t now = micro_monotonic_ns();
+
+	if (daemon->watchdog_ns == 0 || now - daemon->watchdog_sent_ns < daemon->watchdog_ns / DAEMON_WATCHDOG_DIV)
+		return;
+
+	for (int i = 0; i < daemon->nunits; i++) {
+		struct daemon_unit *unit = &daemon->units[i];
+
+		if (unit->active && now - unit->sampled_ns > daemon->watchdog_ns)
+			return;
 	}
 
-	if (board->has_silo == 0) {
-		syslog(LOG_INFO, "Supercaps not present, exiting.");
+	micro_notify("WATCHDOG=1");
+	daemon->watchdog_sent_ns = now;
+}
+
+/* Takes in a sample or capture read finished by the bus worker */
+static void daemon_complete(struct daemon *daemon, micro_req_t *req)
+{
+	struct daemon_unit *unit = req->owner;
+
+	/* A shutdown sleep that came back after the shutdown stopped waiting */
+	if (req == &daemon->sleep_req)
+		return;
+
+	if (req == &unit->capture_req) {
+		if (!unit->capturing)
+			return;
+		if (req->ret < 0)
+			unit->cap->missed++;
+		else
+			micro_capture_add(unit->cap, req->done_ns, req->mv);
 		return;
 	}
 
-	if ((status_flags & MICRO_STATUS_FLAGS_SCAPS_EN) == 0) {
-		syslog(LOG_INFO, "Supercaps not enabled, exiting and not monitoring charge");
+	if (unit->sample_timed_out) {
+		micro_rt_log(LOG_INFO, "%sSupervisor answered after %llu ms", unit->prefix,
+			     (unsigned long long)((req->done_ns - req->submit_ns) / 1000000));
+		unit->sample_timed_out = false;
+	}
+
+	if (req->ret < 0) {
+		unit->metrics.bus_errors++;
+		micro_rt_log(LOG_WARNING, "%sFailed to read supervisor registers: %s", unit->prefix, strerror(req->err));
+		if (++unit->sample_retries <= DAEMON_BUS_RETRIES)
+			daemon_submit_sample(daemon, unit);
 		return;
 	}
+	unit->sample_retries = 0;
+
+	unit->info.snap = req->snap;
+	unit->sampled_ns = req->done_ns;
+	unit->scaps_mv = req->mv;
+	unit->filter_reads = req->filter_reads;
+	unit->filter_bus_ns = req->filter_bus_ns;
+	unit->cur_pct = micro_scaps_mv_pct(unit->scaps_mv);
+	/* Without a power_fail# GPIO the snapshot is the only source */
+	if (unit->line == NULL)
+		unit->power_fail = !!(unit->info.snap.status_flags & MICRO_STATUS_FLAGS_POWER_FAIL);
+	daemon_publish(unit);
+	daemon_watchdog(daemon);
+
+	micro_sched_add(&unit->sched, unit->sampled_ns / 1000000, unit->scaps_mv);
+	if (!unit->power_fail_active)
+		return;
+	micro_predict_add(&unit->pred, unit->sampled_ns / 1000000, unit->scaps_mv);
 
-	chip = init_power_fail_gpio(board, &line, "micro_scaps_monitor_daemon");
+	/* A sample already on the bus when the power failed does not count as
+	 * the first one of the event.
+	 */
+	if (!unit->event_sampled && req->submit_ns < unit->power_fail_ns) {
+		daemon_submit_sample(daemon, unit);
+	} else if (!unit->event_sampled) {
+		unit->event_sampled = true;
+		if (unit->trace_event)
+			unit->trace_event->sample_ns = unit->sampled_ns;
+	}
+}
 
-	while (true) {
-		current_power_fail = read_power_fail_status(line, board);
-
-		if (current_power_fail && !power_fail_active) {
-			monitor_i2c = true;
-			power_fail_active = true;
-			sleep_time = 100000; // Reset polling to 100ms
-			print_interval = 10; // Print every 1s (10 x 100ms)
-			suppress_message = false; // Allow prints again
+static size_t daemon_sock_handler(uint32_t cmd, void *reply, size_t size, void *ctx)
+{
+	struct daemon *daemon = ctx;
+	uint32_t index = cmd >> MICRO_SOCK_CMD_SUPERVISOR_SHIFT;
+	struct daemon_unit *unit;
+
+	_Static_assert(sizeof(micro_stats_t) <= MICRO_SOCK_MAX_REPLY, "stats must fit in a socket reply");
+	_Static_assert(sizeof(micro_latency_t) <= MICRO_SOCK_MAX_REPLY, "latency must fit in a socket reply");
+
+	if (index >= daemon->nunits)
+		return 0;
+	unit = &daemon->units[index];
+
+	switch (cmd & MICRO_SOCK_CMD_MASK) {
+	case MICRO_SOCK_CMD_INFO:
+		/* Never waits on the bus, a stale reply is refreshed for next time */
+		if (micro_monotonic_ns() - unit->sampled_ns > DAEMON_INFO_MAX_AGE_MS * 1000000ULL)
+			daemon_sample(daemon, unit);
+		memcpy(reply, &unit->info, sizeof(unit->info));
+		return sizeof(unit->info);
+	case MICRO_SOCK_CMD_STATS:
+		/* Counted per process, not per supervisor */
+		if (!micro_stats_enabled)
+			return 0;
+		micro_stats_snapshot(reply);
+		return sizeof(micro_stats);
+	case MICRO_SOCK_CMD_LATENCY:
+		daemon->latency.log_dropped = micro_rt_log_dropped();
+		memcpy(reply, &daemon->latency, sizeof(daemon->latency));
+		return sizeof(daemon->latency);
+	default:
+		return 0;
+	}
+}
+
+/* Arms a periodic timer, or disarms it if interval_ns is 0 */
+static void arm_timer_ns(int timerfd, uint64_t interval_ns)
+{
+	struct itimerspec its = { 0 };
+
+	its.it_value.tv_sec = interval_ns / 1000000000ULL;
+	its.it_value.tv_nsec = interval_ns % 1000000000ULL;
+	its.it_interval = its.it_value;
+
+	if (timerfd_settime(timerfd, 0, &its, NULL) < 0) {
+		syslog(LOG_ERR, "Failed to arm timer: %s", strerror(errno));
+		exit(1);
+	}
+}
+
+static void arm_sample_timer(int timerfd, int interval_ms)
+{
+	arm_timer_ns(timerfd, interval_ms * 1000000ULL);
+}
+
+static int create_timer(void)
+{
+	int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+	if (timerfd < 0) {
+		syslog(LOG_ERR, "Failed to create timer: %s", strerror(errno));
+		exit(1);
+	}
+	return timerfd;
+}
+
+/* Writes out the discharge capture of a power fail event that has ended, or
+ * is about to end in a reboot. The first supervisor keeps the plain file
+ * names, the others are told apart by their name.
+ */
+static void finish_capture(struct daemon_unit *unit, const micro_daemon_opts_t *opts)
+{
+	char path[256];
+
+	if (!unit->capturing)
+		return;
+	unit->capturing = false;
+
+	arm_timer_ns(unit->capture_timerfd, 0);
+	if (micro_capture_dump(unit->cap, opts->capture_dir, opts->capture_format, unit->index ? unit->name : NULL,
+			       path, sizeof(path)) < 0) {
+		micro_rt_log(LOG_ERR, "%sFailed to write discharge capture to %s: %s", unit->prefix, opts->capture_dir,
+			     strerror(errno));
+		return;
+	}
+	micro_rt_log(LOG_INFO, "%sWrote %u discharge samples at %d Hz (%u missed) to %s", unit->prefix,
+		     unit->cap->count, unit->cap->hz, unit->cap->missed, path);
+}
+
+/* Sets up everything needed to watch one supervisor. Returns false, leaving
+ * the unit inactive, if it has no supercaps to watch.
+ */
+static bool daemon_unit_open(struct daemon *daemon, struct daemon_unit *unit, const micro_supervisor_t *sup,
+			     int index)
+{
+	const micro_daemon_opts_t *opts = daemon->opts;
+	char shm_path[64];
+
+	unit->index = index;
+	unit->dev = sup->dev;
+	unit->board = sup->board;
+	unit->reboot_pct = sup->reboot_pct;
+	unit->empty_ms = -1;
+	unit->timerfd = -1;
+	unit->capture_timerfd = -1;
+	snprintf(unit->name, sizeof(unit->name), "%d-%04x", sup->dev->i2cbus, sup->dev->i2caddr);
+	if (daemon->nunits > 1)
+		snprintf(unit->prefix, sizeof(unit->prefix), "%s: ", unit->name);
+
+	assert(unit->reboot_pct <= 100);
+	unit->reboot_mv = scaps_pct_mv(unit->reboot_pct);
+	micro_sched_init(&unit->sched, opts->sample_min_ms, opts->sample_max_ms);
+	micro_filter_init(&unit->filter, opts->filter, opts->filter_samples);
+	unit->has_energy = (micro_energy_init(&unit->energy, unit->board) == 0);
+	unit->holdup_ms = -1;
+	unit->sample_req.dev = unit->dev;
+	unit->sample_req.op = MICRO_REQ_SNAPSHOT;
+	unit->sample_req.owner = unit;
+	unit->sample_req.filter = &unit->filter;
+	unit->capture_req.dev = unit->dev;
+	unit->capture_req.op = MICRO_REQ_ADC_8;
+	unit->capture_req.owner = unit;
+
+	if (micro_read_info(unit->dev, &unit->info) < 0) {
+		syslog(LOG_ERR, "%sFailed to read supervisor registers: %s", unit->prefix, strerror(errno));
+		exit(1);
+	}
+	unit->sampled_ns = micro_monotonic_ns();
+
+	if (unit->board->has_silo == 0) {
+		syslog(LOG_INFO, "%sSupercaps not present, not monitoring charge", unit->prefix);
+		return false;
+	}
+
+	if ((unit->info.snap.status_flags & MICRO_STATUS_FLAGS_SCAPS_EN) == 0) {
+		syslog(LOG_INFO, "%sSupercaps not enabled, not monitoring charge", unit->prefix);
+		return false;
+	}
+
+	if (opts->capture_hz) {
+		unit->cap = micro_capture_alloc(opts->capture_hz);
+		if (unit->cap == NULL) {
+			syslog(LOG_ERR, "Failed to allocate discharge capture: %s", strerror(errno));
+			exit(1);
+		}
+	}
+
+	unit->chip = init_power_fail_gpio(unit->board, &unit->line, "micro_scaps_monitor_daemon",
+					  GPIOD_LINE_REQUEST_EVENT_BOTH_EDGES);
+	unit->timerfd = create_timer();
+	unit->capture_timerfd = create_timer();
+
+	/* Telemetry is a convenience, power fail handling carries on without it */
+	if (!opts->replay) {
+		if (index == 0)
+			snprintf(shm_path, sizeof(shm_path), "%s", MICRO_SHM_PATH);
+		else
+			snprintf(shm_path, sizeof(shm_path), MICRO_SHM_SUPERVISOR_PATH, index);
+		unit->shm = micro_shm_open(shm_path, 1);
+		if (unit->shm == NULL)
+			syslog(LOG_WARNING, "Failed to open %s: %s", shm_path, strerror(errno));
+	}
+
+	/* Edges are only reported from here on, so pick up the current level */
+	unit->power_fail = read_power_fail_status(unit->line, unit->board, &unit->info.snap);
+	unit->scaps_mv = unit->info.snap.adc[MICRO_ADC_CHANNEL(MICRO_ADC_8)];
+	unit->cur_pct = micro_scaps_mv_pct(unit->scaps_mv);
+	daemon_publish(unit);
+	micro_sched_add(&unit->sched, unit->sampled_ns / 1000000, unit->scaps_mv);
+
+	unit->active = true;
+	return true;
+}
+
+static void daemon_unit_close(struct daemon_unit *unit)
+{
+	if (unit->shm)
+		micro_shm_close(unit->shm);
+	if (unit->capture_timerfd >= 0)
+		close(unit->capture_timerfd);
+	if (unit->timerfd >= 0)
+		close(unit->timerfd);
+	free(unit->cap);
+	if (unit->chip)
+		gpiod_chip_close(unit->chip);
+}
+
+/* Acts on the latest readings of one supervisor: starts and ends power fail
+ * events, reboots once the supercaps run low and re-arms the sample timer.
+ */
+static void daemon_unit_update(struct daemon *daemon, struct daemon_unit *unit)
+{
+	const micro_daemon_opts_t *opts = daemon->opts;
+	bool reboot = false;
+	char energy[64] = "";
+	int64_t eta_ms, age_ms;
+	uint32_t load_mw;
+	int interval, watchdog_ms;
+
+	if (unit->power_fail && !unit->power_fail_active) {
+		unit->power_fail_active = true;
+		unit->power_fail_ns = micro_monotonic_ns();
+		unit->metrics.power_fail_events++;
+		/* Without an edge, the sample that noticed the power fail stands in
+		 * for it and there is no wakeup to measure.
+		 */
+		if (unit->edge_ns)
+			unit->trace_event = micro_trace_begin(daemon->trace, unit->index, 0, unit->edge_ns,
+							      unit->seen_ns);
+		else
+			unit->trace_event = micro_trace_begin(daemon->trace, unit->index, MICRO_TRACE_POLLED,
+							      unit->sampled_ns, 0);
+		unit->edge_ns = 0;
+		if (unit->cap) {
+			micro_capture_start(unit->cap, micro_monotonic_ns());
+			arm_timer_ns(unit->capture_timerfd, 1000000000ULL / unit->cap->hz);
+			unit->capturing = true;
+		}
+		micro_predict_reset(&unit->pred);
+		micro_sched_reset(&unit->sched);
+		unit->filter_reset = true;
+		unit->event_sampled = false;
+		daemon_sample(daemon, unit);
+	}
+
+	/* With an energy model, the time left is the usable energy over the
+	 * load measured from the discharge so far, otherwise the fitted line
+	 * is followed down to MIN_CHARGE_MV. Either runs from the newest
+	 * sample, which may be getting old while the bus is slow to answer.
+	 */
+	if (unit->power_fail_active) {
+		age_ms = (micro_monotonic_ns() - unit->sampled_ns) / 1000000;
+		unit->holdup_ms = -1;
+		if (unit->has_energy) {
+			load_mw = micro_energy_load_mw(&unit->energy, micro_predict_slope(&unit->pred));
+			if (load_mw) {
+				unit->load_mw = load_mw;
+				unit->holdup_ms = micro_energy_ms_left(&unit->energy, unit->scaps_mv, load_mw);
+				unit->holdup_ms = (unit->holdup_ms > age_ms) ? unit->holdup_ms - age_ms : 0;
+			}
+		}
+		if (opts->shutdown_budget_ms && unit->has_energy) {
+			unit->empty_ms = unit->holdup_ms;
+		} else if (opts->shutdown_budget_ms) {
+			unit->empty_ms = micro_predict_ms_to(&unit->pred, MIN_CHARGE_MV);
+			if (unit->empty_ms >= 0)
+				unit->empty_ms = (unit->empty_ms > age_ms) ? unit->empty_ms - age_ms : 0;
+		}
+	}
+
+	/* Log at most once a second however fast the sampling is */
+	if ((unit->power_fail_active || unit->cur_pct < 100) && unit->sampled_ns - unit->logged_ns >= 1000000000ULL) {
+		if (unit->has_energy && unit->power_fail_active && unit->holdup_ms >= 0)
+			snprintf(energy, sizeof(energy), " | Energy: %.1f J, %.1f s at %.2f W",
+				 micro_energy_mj(&unit->energy, unit->scaps_mv) / 1000.0, unit->holdup_ms / 1000.0,
+				 unit->load_mw / 1000.0);
+		else if (unit->has_energy)
+			snprintf(energy, sizeof(energy), " | Energy: %.1f J",
+				 micro_energy_mj(&unit->energy, unit->scaps_mv) / 1000.0);
+		micro_rt_log(LOG_INFO, "%sSupercap Charge: %d%% (Reboot Threshold: %d%%) | Power Fail: %s%s", unit->prefix,
+			     unit->cur_pct, unit->reboot_pct, unit->power_fail ? "YES" : "No", energy);
+		unit->logged_ns = unit->sampled_ns;
+	}
+
+	if (daemon->shutdown.fired) {
+		/* Already on the way down */
+	} else if (unit->power_fail_active && unit->cur_pct < unit->reboot_pct) {
+		micro_rt_log(LOG_INFO, "%sDischarge percentage below threshold, rebooting...", unit->prefix);
+		reboot = true;
+	} else if (unit->power_fail_active && unit->empty_ms >= 0 && unit->empty_ms < opts->shutdown_budget_ms) {
+		micro_rt_log(LOG_INFO,
+			     "%sSupercaps predicted empty in %lld ms, within the %d ms shutdown budget, rebooting...",
+			     unit->prefix, (long long)unit->empty_ms, opts->shutdown_budget_ms);
+		reboot = true;
+	}
+
+	if (reboot && unit->trace_event) {
+		unit->trace_event->crossing_ns = unit->sampled_ns;
+		unit->trace_event->decision_ns = micro_monotonic_ns();
+	}
+
+	/* Whichever supervisor runs low takes the whole system down. The
+	 * emergency sleep is always armed on the first one, which is the
+	 * board's own. Writing out the captures is blocking file I/O, so it
+	 * waits until the shutdown is under way, which means emergency
+	 * shutdowns lose them. Like every other bus access, the sleep goes
+	 * through the worker, but the shutdown only waits a bounded time for
+	 * it in case the worker is stuck on a request.
+	 */
+	if (reboot) {
+		if (unit->trace_event)
+			unit->trace_event->shutdown_ns = micro_monotonic_ns();
+		micro_shutdown_fire(&daemon->shutdown, &daemon->worker, &daemon->sleep_req);
+		for (int i = 0; i < daemon->nunits; i++)
+			finish_capture(&daemon->units[i], opts);
+	}
+
+	if (!unit->power_fail && unit->power_fail_active) {
+		micro_rt_log(LOG_INFO, "%sPower restored. Supercap Charge: %d%%", unit->prefix, unit->cur_pct);
+		unit->power_fail_active = false;
+		if (unit->trace_event)
+			unit->trace_event->restored_ns = micro_monotonic_ns();
+		unit->trace_event = NULL;
+		unit->metrics.power_fail_restored++;
+		unit->metrics.holdup_last_s = (micro_monotonic_ns() - unit->power_fail_ns) / 1e9;
+		unit->metrics.holdup_total_s += unit->metrics.holdup_last_s;
+		if (unit->metrics.holdup_last_s > unit->metrics.holdup_max_s)
+			unit->metrics.holdup_max_s = unit->metrics.holdup_last_s;
+		daemon->metrics_ns = 0;
+		micro_sched_reset(&unit->sched);
+		finish_capture(unit, opts);
+	}
+
+	/* While discharging, sample densely as the supercaps near
+	 * whichever comes first of the reboot threshold and the shutdown
+	 * budget. While recharging, pace the samples to the time left
+	 * until full. Once full there is nothing left to watch until the
+	 * next power_fail# edge.
+	 */
+	if (unit->power_fail_active) {
+		eta_ms = micro_sched_ms_to(&unit->sched, unit->reboot_mv);
+		if (unit->empty_ms >= 0 && (eta_ms < 0 || unit->empty_ms - opts->shutdown_budget_ms < eta_ms))
+			eta_ms = unit->empty_ms - opts->shutdown_budget_ms;
+		/* A slope that does not show the discharge yet comes from the
+		 * first few samples, where one ADC step of noise is enough to
+		 * flatten it. Keep sampling as fast as allowed until it does.
+		 */
+		if (eta_ms < 0)
+			eta_ms = 0;
+		interval = micro_sched_interval(&unit->sched, eta_ms);
+	} else if (unit->cur_pct < 100) {
+		interval = micro_sched_interval(&unit->sched, micro_sched_ms_to(&unit->sched, MAX_CHARGE_MV));
+		if (unit->line == NULL && interval > DAEMON_POLL_MS)
+			interval = DAEMON_POLL_MS;
+	} else if (unit->line == NULL) {
+		interval = DAEMON_POLL_MS;
+	} else {
+		interval = opts->metrics_path ? DAEMON_METRICS_IDLE_MS : 0;
+	}
+
+	/* The watchdog is only fed by samples, so they can never stop */
+	watchdog_ms = daemon->watchdog_ns / DAEMON_WATCHDOG_DIV / 1000000;
+	if (daemon->watchdog_ns && (interval == 0 || interval > watchdog_ms))
+		interval = watchdog_ms ? watchdog_ms : 1;
+
+	if (interval != unit->sample_interval) {
+		unit->sample_interval = interval;
+		arm_sample_timer(unit->timerfd, unit->sample_interval);
+	}
+}
+
+/* Rewrites the metrics file with every watched supervisor in it. The
+ * filesystem is left alone while any of them is running from its supercaps.
+ */
+static void daemon_write_metrics(struct daemon *daemon)
+{
+	micro_metrics_source_t sources[MICRO_DAEMON_MAX_SUPERVISORS];
+	const char *path = daemon->opts->metrics_path;
+	uint64_t sampled_ns = 0;
+	int nsources = 0;
+
+	if (path == NULL)
+		return;
+
+	for (int i = 0; i < daemon->nunits; i++) {
+		struct daemon_unit *unit = &daemon->units[i];
+
+		if (!unit->active)
 			continue;
+		if (unit->power_fail_active)
+			return;
+		if (unit->sampled_ns > sampled_ns)
+			sampled_ns = unit->sampled_ns;
+		unit->metrics.scaps_filtered_mv = unit->scaps_mv;
+		unit->metrics.filter_reads = unit->filter_reads;
+		unit->metrics.filter_bus_s = unit->filter_bus_ns / 1e9;
+		unit->metrics.load_w = NAN;
+		unit->metrics.holdup_s = NAN;
+		if (unit->has_energy && unit->load_mw) {
+			unit->metrics.load_w = unit->load_mw / 1000.0;
+			unit->metrics.holdup_s = micro_energy_ms_left(&unit->energy, unit->scaps_mv, unit->load_mw) / 1000.0;
 		}
+		sources[nsources].name = unit->name;
+		sources[nsources].board = unit->board;
+		sources[nsources].info = &unit->info;
+		sources[nsources].energy = unit->has_energy ? &unit->energy : NULL;
+		sources[nsources].metrics = &unit->metrics;
+		nsources++;
+	}
+
+	if (sampled_ns - daemon->metrics_ns < DAEMON_METRICS_MIN_MS * 1000000ULL)
+		return;
+
+	if (micro_metrics_write(path, sources, nsources) < 0) {
+		if (!daemon->metrics_failed)
+			micro_rt_log(LOG_WARNING, "Failed to write %s: %s", path, strerror(errno));
+		daemon->metrics_failed = true;
+	} else {
+		daemon->metrics_failed = false;
+	}
+	daemon->metrics_ns = sampled_ns;
+}
+
+enum { PFD_POWER_FAIL, PFD_SAMPLE_TIMER, PFD_CAPTURE_TIMER, PFD_UNIT_COUNT };
 
-		if (monitor_i2c) {
-			cur_pct = micro_scaps_remaining_pct(i2cfd, board);
+/* poll() skips negative fds, leaving only the timer without a GPIO */
+static void daemon_unit_pollfds(struct daemon_unit *unit, struct pollfd *pfds)
+{
+	pfds[PFD_POWER_FAIL].fd = unit->line ? gpiod_line_event_get_fd(unit->line) : -1;
+	pfds[PFD_POWER_FAIL].events = POLLIN;
+	pfds[PFD_SAMPLE_TIMER].fd = unit->timerfd;
+	pfds[PFD_SAMPLE_TIMER].events = POLLIN;
+	pfds[PFD_CAPTURE_TIMER].fd = unit->capture_timerfd;
+	pfds[PFD_CAPTURE_TIMER].events = POLLIN;
+}
+
+static void daemon_unit_process(struct daemon *daemon, struct daemon_unit *unit, struct pollfd *pfds)
+{
+	struct gpiod_line_event event;
+	uint64_t expirations;
+
+	if (pfds[PFD_POWER_FAIL].revents & POLLIN) {
+		if (gpiod_line_event_read(unit->line, &event) < 0) {
+			syslog(LOG_ERR, "%sFailed to read power_fail# event: %s", unit->prefix, strerror(errno));
+			exit(1);
+		}
+		if (power_fail_event_status(&event, unit->board) && !unit->power_fail) {
+			unit->edge_ns = power_fail_event_ns(&event);
+			unit->seen_ns = micro_monotonic_ns();
 		}
+		unit->power_fail = power_fail_event_status(&event, unit->board);
+		daemon_publish(unit);
+	}
 
-		if ((power_fail_active || cur_pct < 100) && counter % print_interval == 0) {
-			syslog(LOG_INFO, "Supercap Charge: %d%% (Reboot Threshold: %d%%) | Power Fail: %s",
-			       cur_pct, reboot_pct, current_power_fail ? "YES" : "No");
+	/* Nothing here may allocate or log. A tick whose read is still with
+	 * the worker is missed rather than queued behind it.
+	 */
+	if (pfds[PFD_CAPTURE_TIMER].revents & POLLIN) {
+		if (read(unit->capture_timerfd, &expirations, sizeof(expirations)) == sizeof(expirations) &&
+		    unit->capturing) {
+			micro_latency_timerfd(&daemon->latency, unit->capture_timerfd, expirations);
+			if (micro_worker_submit(&daemon->worker, &unit->capture_req) < 0)
+				unit->cap->missed++;
+			unit->cap->missed += expirations - 1;
 		}
+	}
 
-		if (power_fail_active && cur_pct < reboot_pct) {
-			syslog(LOG_INFO, "Discharge percentage below threshold, rebooting...");
-			system("/sbin/reboot");
+	if (pfds[PFD_SAMPLE_TIMER].revents & POLLIN) {
+		if (read(unit->timerfd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+			micro_latency_timerfd(&daemon->latency, unit->timerfd, expirations);
+			daemon_sample(daemon, unit);
 		}
+	}
+}
 
-		if (!current_power_fail && power_fail_active) {
-			syslog(LOG_INFO, "Power restored. Supercap Charge: %d%%", cur_pct);
-			power_fail_active = false;
+/* Monitors supercaps and triggers a reboot if charge is too low while power fails
+ *
+ * Each supervisor in sups is watched independently, with its own power_fail#
+ * line, reboot threshold and sampling, and the first to run low takes the
+ * system down. All of them share one poll() loop, so watching several
+ * supervisors costs no more processes or wakeups than watching one.
+ *
+ * The daemon blocks in poll() on the power_fail# edge event fds and a timerfd
+ * per supervisor. While the supercaps discharge or recharge, micro_sched
+ * paces the timer between opts->sample_min_ms and opts->sample_max_ms from
+ * the measured slope, and a discharge whose slope is not known yet is
+ * sampled every sample_min_ms. Once the supercaps are full and power is
+ * good, the timer only runs for the metrics file and the systemd watchdog,
+ * and is disarmed entirely without either until the next power_fail# edge.
+ * Without a power_fail# GPIO, the status flags are polled every
+ * DAEMON_POLL_MS instead.
+ *
+ * The latest readings are also served on MICRO_SOCK_PATH, so that
+ * tsmicroctl --info does not have to touch the bus while the daemon runs, and
+ * published to the seqlocked page at MICRO_SHM_PATH for local readers. Further
+ * supervisors are selected with MICRO_SOCK_CMD_SUPERVISOR() and published at
+ * MICRO_SHM_SUPERVISOR_PATH.
+ *
+ * With opts->capture_hz set, MICRO_ADC_8 is additionally sampled at that rate
+ * into a preallocated ring for as long as power has failed, and written out
+ * when power returns or once the shutdown has been started.
+ *
+ * With opts->shutdown_budget_ms set, the discharge is also extrapolated from
+ * the recent samples and the reboot starts as soon as the supercaps are
+ * predicted to be empty within the budget, even if reboot_pct is not reached.
+ * The shutdown itself is done in-process by opts->shutdown_strategy, exactly
+ * once.
+ *
+ * With opts->rt_priority set, the loop runs SCHED_FIFO with all memory locked
+ * and hands its log messages to a separate thread, so nothing between a
+ * wakeup and the reboot decision allocates or blocks. The wakeup latency of
+ * every timer is measured either way and served as MICRO_SOCK_CMD_LATENCY.
+ *
+ * For boards with an energy model in micro_energy.h, the energy left and the
+ * holdup time at the measured load are logged, and opts->shutdown_budget_ms
+ * is weighed against that holdup time instead.
+ *
+ * Run as a Type=notify service, the daemon reports READY=1 once it is
+ * monitoring, and if the service has a watchdog, pings it after successful
+ * samples as described at daemon_watchdog(). With opts->loop_budget_us set,
+ * loop iterations that take longer are counted with the wakeup latency and
+ * logged.
+ *
+ * With opts->filter set, every sample is filtered as described in
+ * micro_filter.h and all decisions are made on the filtered voltage.
+ *
+ * With opts->trace_path set, the time of each stage of the response to every
+ * power fail, from the kernel's power_fail# edge timestamp to the shutdown
+ * being invoked, is recorded to that file as described in micro_trace.h.
+ *
+ * Once the loop is running, its bus reads all go through the worker thread in
+ * micro_worker.h, and every consumer of the readings, the socket, the shared
+ * page, the metrics and the captures, is served from what the worker returns.
+ * A supervisor that stops answering holds up only its own readings. Its
+ * power_fail# edges are still handled, the shutdown prediction keeps running
+ * down from the last sample, and failed reads are retried.
+ */
+void micro_scaps_monitor_daemon(const micro_supervisor_t *sups, int nsups, const micro_daemon_opts_t *opts)
+{
+	struct daemon daemon = { .opts = opts, .sups = sups, .nunits = nsups };
+	struct pollfd pfds[MICRO_DAEMON_MAX_SUPERVISORS * PFD_UNIT_COUNT + 1 + MICRO_SOCK_NFDS];
+	struct pollfd *worker_pfd = &pfds[nsups * PFD_UNIT_COUNT];
+	struct pollfd *sock_pfds = &pfds[nsups * PFD_UNIT_COUNT + 1];
+	/* A replay must not take the socket or shared pages from a live daemon */
+	const char *sock_path = opts->replay ? NULL : MICRO_SOCK_PATH;
+	micro_sock_server_t server;
+	micro_req_t *req;
+	uint64_t woke_ns = 0, loop_ns;
+	int nactive = 0;
+
+	openlog("tsmicroctl", LOG_PID | LOG_CONS, LOG_DAEMON);
+
+	assert(nsups > 0 && nsups <= MICRO_DAEMON_MAX_SUPERVISORS);
+
+	for (int i = 0; i < nsups; i++) {
+		struct daemon_unit *unit = &daemon.units[i];
+
+		if (daemon_unit_open(&daemon, unit, &sups[i], i))
+			nactive++;
+		daemon_unit_pollfds(unit, &pfds[i * PFD_UNIT_COUNT]);
+	}
+
+	/* Exiting without READY=1 would fail a Type=notify unit's start */
+	if (nactive == 0) {
+		syslog(LOG_INFO, "No supercaps to monitor, exiting.");
+		micro_notify_init();
+		micro_notify("READY=1\nSTOPPING=1");
+		for (int i = 0; i < nsups; i++)
+			daemon_unit_close(&daemon.units[i]);
+		closelog();
+		return;
+	}
 
-			if (cur_pct == 100) {
-				monitor_i2c = false;
-				sleep_time = 1000000; // Reduce polling to 1 second
-				print_interval = 1;   // Print once per sleep cycle (1s)
-				suppress_message = true;
+	micro_shutdown_prepare(&daemon.shutdown, opts->shutdown_strategy, opts->shutdown_sleep_s);
+	daemon.sleep_req.dev = sups[0].dev;
+	daemon.sleep_req.op = MICRO_REQ_WRITE;
+
+	if (opts->trace_path) {
+		daemon.trace = micro_trace_open(opts->trace_path);
+		if (daemon.trace == NULL)
+			syslog(LOG_WARNING, "Failed to open %s: %s", opts->trace_path, strerror(errno));
+	}
+
+	if (micro_sock_server_open(&server, sock_path) < 0)
+		syslog(LOG_WARNING, "Failed to open %s: %s", sock_path, strerror(errno));
+
+	/* Everything the loop needs exists by now, so it can all be locked in */
+	if (opts->rt_priority) {
+		if (micro_rt_log_start() < 0)
+			syslog(LOG_WARNING, "Failed to start log thread, logging directly: %s", strerror(errno));
+		if (micro_rt_setup(opts->rt_priority, opts->rt_cpus) < 0) {
+			syslog(LOG_ERR, "Failed to enter real-time mode: %s", strerror(errno));
+			exit(1);
+		}
+		syslog(LOG_INFO, "Running SCHED_FIFO at priority %d with memory locked", opts->rt_priority);
+	}
+
+	/* Started last so that it runs with the loop's priority and CPUs */
+	if (micro_worker_start(&daemon.worker) < 0) {
+		syslog(LOG_ERR, "Failed to start bus worker: %s", strerror(errno));
+		exit(1);
+	}
+	worker_pfd->fd = daemon.worker.complete_fd;
+	worker_pfd->events = POLLIN;
+
+	/* Every unit has been read successfully by now */
+	daemon.watchdog_ns = micro_notify_init() * 1000;
+	daemon.latency.loop_budget_us = opts->loop_budget_us;
+	micro_notify("READY=1");
+	if (daemon.watchdog_ns)
+		syslog(LOG_INFO, "Feeding the systemd watchdog every %llu ms",
+		       (unsigned long long)(daemon.watchdog_ns / DAEMON_WATCHDOG_DIV / 1000000));
+
+	while (true) {
+		for (int i = 0; i < nsups; i++) {
+			if (daemon.units[i].active)
+				daemon_unit_update(&daemon, &daemon.units[i]);
+		}
+
+		daemon_write_metrics(&daemon);
+
+		micro_sock_server_pollfds(&server, sock_pfds);
+
+		if (woke_ns) {
+			loop_ns = micro_monotonic_ns() - woke_ns;
+			if (loop_ns > daemon.latency.loop_max_ns)
+				daemon.latency.loop_max_ns = loop_ns;
+			if (opts->loop_budget_us && loop_ns > opts->loop_budget_us * 1000ULL) {
+				daemon.latency.loop_overruns++;
+				if (woke_ns - daemon.overrun_logged_ns >= DAEMON_OVERRUN_LOG_MS * 1000000ULL) {
+					micro_rt_log(LOG_WARNING, "Loop iteration took %llu us, over the %d us budget (%llu so far)",
+						     (unsigned long long)(loop_ns / 1000), opts->loop_budget_us,
+						     (unsigned long long)daemon.latency.loop_overruns);
+					daemon.overrun_logged_ns = woke_ns;
+				}
 			}
+			woke_ns = 0;
 		}
 
-		if (suppress_message && cur_pct == 100 && !power_fail_active) {
-			usleep(sleep_time);
-			continue;
+		if (poll(pfds, nsups * PFD_UNIT_COUNT + 1 + MICRO_SOCK_NFDS, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "Failed to poll power_fail#: %s", strerror(errno));
+			exit(1);
 		}
+		woke_ns = micro_monotonic_ns();
 
-		usleep(sleep_time);
-		counter++;
+		for (int i = 0; i < nsups; i++)
+			daemon_unit_process(&daemon, &daemon.units[i], &pfds[i * PFD_UNIT_COUNT]);
+
+		if (worker_pfd->revents & POLLIN) {
+			while ((req = micro_worker_complete(&daemon.worker)) != NULL)
+				daemon_complete(&daemon, req);
+		}
+
+		/* Power fail handling above always comes first */
+		micro_sock_server_process(&server, sock_pfds, daemon_sock_handler, &daemon);
 	}
 
-	closelog();
+	micro_worker_stop(&daemon.worker);
+	micro_sock_server_close(&server, sock_path);
+	micro_trace_close(daemon.trace);
+	for (int i = 0; i < nsups; i++)
+		daemon_unit_close(&daemon.units[i]);
 
-	gpiod_chip_close(chip);
+	closelog();
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdio.h>
+
 #define MICRO_ADC_0 0
 #define MICRO_ADC_1 2
 #define MICRO_ADC_2 4
@@ -24,45 +26,222 @@
 #define MICRO_REVISION 2048
 #define MICRO_BUILD_STRING 4096
 
+#define MICRO_ADC_CHANNEL(reg) ((reg) / 2)
+
+#define MICRO_SLEEP_MAX_SECONDS (UINT32_MAX / 1000)
+
+/* Fills in the 5 bytes written at MICRO_CMD to turn off power to everything
+ * for seconds. The micro counts the sleep in 10ms units, rounded up here.
+ */
+static inline void micro_sleep_cmd(uint8_t buf[5], uint32_t seconds)
+{
+	uint32_t ms = seconds * 1000;
+
+	if (ms % 10)
+		ms = (ms / 10) + 1;
+	else
+		ms = ms / 10;
+
+	buf[0] = ms & 0xff;
+	buf[1] = (ms >> 8) & 0xff;
+	buf[2] = (ms >> 16) & 0xff;
+	buf[3] = (ms >> 24) & 0xff;
+	buf[4] = MICRO_CMD_SLEEP;
+}
+
+/* Contiguous register block from MICRO_ADC_0 through MICRO_CHARGE_CURRENT,
+ * laid out exactly as the micro returns it from a single burst read. All
+ * 16-bit values are in host order once returned by micro_read_snapshot().
+ */
+typedef struct __attribute__((packed, aligned(2))) micro_snapshot {
+    uint16_t adc[11];
+    uint8_t status_flags;
+    uint8_t reserved;
+    uint16_t charge_current_default;
+    uint16_t charge_current;
+} micro_snapshot_t;
+
+/* Everything --info reports. Filled either directly from the micro by
+ * micro_read_info() or by a running daemon over its socket.
+ */
+typedef struct micro_info {
+    uint8_t revision;
+    char build[80];
+    micro_snapshot_t snap;
+} micro_info_t;
+
+struct i2c_msg;
+struct micro_filter;
+
+/* Bus backend used by micro_read()/micro_write(). transfer() submits all of
+ * msgs as a single combined transaction, like the I2C_RDWR ioctl, and
+ * returns a negative value with errno set on failure.
+ */
+typedef struct micro_transport {
+    const char *name;
+    int (*open)(int i2cbus, int i2caddr);
+    int (*transfer)(int fd, struct i2c_msg *msgs, int nmsgs);
+} micro_transport_t;
+
+extern const micro_transport_t micro_i2c_transport;
+
+/* One ADC channel as --info reports it. scale turns the raw reading into the
+ * reported value as a 16.16 fixed point multiplier, worked out at compile
+ * time by the macros below.
+ */
+typedef struct micro_adc_channel {
+    uint16_t reg;     /* MICRO_ADC_* */
+    const char *name; /* --info key */
+    uint32_t scale;
+} micro_adc_channel_t;
+
+#define MICRO_ADC_SCALE_SHIFT 16
+#define MICRO_ADC_SCALE(num, den) ((uint32_t)((((uint64_t)(num) << MICRO_ADC_SCALE_SHIFT) + (den) / 2) / (den)))
+
+/* Reported exactly as the micro returns it */
+#define MICRO_ADC_RAW MICRO_ADC_SCALE(1, 1)
+
+/* mV at the top of a resistor divider of r_top over r_bottom, as read by the
+ * micro's 10-bit ADC against its 2.5V reference.
+ */
+#define MICRO_ADC_DIVIDER(r_top, r_bottom) MICRO_ADC_SCALE(2500ULL * ((r_top) + (r_bottom)), 1023ULL * (r_bottom))
+
+#define MICRO_ADC_MAX_CHANNELS 11
+
+/* Supercap voltage that micro_scaps_remaining_pct() reports as 100% */
+#define MICRO_SCAPS_FULL_MV 4800
+
 typedef struct board {
     const char *compatible;
     int i2c_bus;
     int i2c_chip;
-    void (*info_function)(int i2cfd, struct board *board);
+    void (*info_function)(struct board *board, const micro_info_t *info, FILE *out);
     const char *power_fail_bank;
     int power_fail_io;
     int power_fail_active;
     int has_silo;
     int max_current;
     int min_current;
+    const micro_adc_channel_t *adc_channels;
+    int adc_nchannels;
+    int scaps_capacitance_mf; /* Supercap bank as seen at MICRO_ADC_8, 0 if not characterized */
+    int scaps_floor_mv;       /* Lowest voltage the board still runs from */
+    int scaps_efficiency_pct; /* Of the converter between the supercaps and the load */
 } board_t;
 
-int micro_init(int i2cbus, int i2caddr);
-int micro_read(int i2cfd, uint16_t addr, void *data, size_t size);
-int micro_write(int i2cfd, uint16_t addr, const void *data, size_t size);
+/* An open supervisor. Every bus access goes through one of these, so a
+ * process can talk to any number of supervisors on any number of buses.
+ */
+typedef struct micro_dev {
+    int fd;
+    int i2cbus;
+    int i2caddr;
+    const micro_transport_t *transport;
+} micro_dev_t;
+
+void micro_set_transport(const micro_transport_t *transport);
+uint64_t micro_monotonic_ns(void);
+
+/* Combined transaction builder
+ *
+ * Reads and writes queued with micro_xfer_read()/micro_xfer_write() go out
+ * as one I2C_RDWR from micro_xfer_submit(), with a repeated start between
+ * messages, so no other bus user can get in between them. A write that starts
+ * where the previous queued write ended is merged into its message, relying
+ * on the micro auto-incrementing the register address. Reads land in the
+ * caller's buffers once the transaction is submitted.
+ */
+#define MICRO_XFER_MAX_OPS 8
+#define MICRO_XFER_BUF_SIZE 4096
+
+typedef struct micro_xfer_op {
+    uint16_t addr;
+    uint16_t len;  /* Data bytes, not counting the register address */
+    uint8_t read;
+    uint8_t *buf;  /* Big-endian register address, followed by the data for writes */
+    void *data;    /* Where a read lands */
+} micro_xfer_op_t;
+
+typedef struct micro_xfer {
+    int nops;
+    size_t used;
+    micro_xfer_op_t ops[MICRO_XFER_MAX_OPS];
+    uint8_t buf[MICRO_XFER_BUF_SIZE];
+} micro_xfer_t;
+
+void micro_xfer_init(micro_xfer_t *xfer);
+void micro_xfer_read(micro_xfer_t *xfer, uint16_t addr, void *data, size_t size);
+void micro_xfer_write(micro_xfer_t *xfer, uint16_t addr, const void *data, size_t size);
+int micro_xfer_submit(micro_dev_t *dev, micro_xfer_t *xfer);
+
+/* Options for micro_scaps_monitor_daemon() */
+typedef struct micro_daemon_opts {
+    int capture_hz;          /* Discharge capture rate, 0 to disable */
+    const char *capture_dir; /* Where discharge captures are written */
+    int capture_format;      /* MICRO_CAPTURE_CSV or MICRO_CAPTURE_BIN */
+    int shutdown_budget_ms;  /* Reboot once the supercaps are predicted empty within this, 0 to disable */
+    int shutdown_strategy;   /* MICRO_SHUTDOWN_* */
+    int shutdown_sleep_s;    /* Seconds of micro_sleep() armed by emergency shutdowns, 0 to skip */
+    int sample_min_ms;       /* Shortest interval the sampling may speed up to */
+    int sample_max_ms;       /* Longest interval the sampling may slow down to */
+    const char *metrics_path; /* node_exporter textfile to keep up to date, NULL to disable */
+    int rt_priority;         /* SCHED_FIFO priority of the daemon loop, 0 to stay SCHED_OTHER */
+    uint64_t rt_cpus;        /* With rt_priority, mask of CPUs to run on, 0 for any */
+    const char *trace_path;  /* Power fail response trace to record to, NULL to disable */
+    int filter;              /* MICRO_FILTER_* applied to every sample */
+    int filter_samples;      /* MICRO_ADC_8 readings per filtered sample */
+    int loop_budget_us;      /* Longest a loop iteration should take, 0 to disable */
+    int replay;              /* Running on a recording, leave the socket and shared pages to a live daemon */
+} micro_daemon_opts_t;
+
+/* One supervisor for micro_scaps_monitor_daemon() to watch. The first is the
+ * board's own; it is the one that arms the sleep of an emergency shutdown.
+ */
+#define MICRO_DAEMON_MAX_SUPERVISORS 8
+
+typedef struct micro_supervisor {
+    micro_dev_t *dev;
+    board_t *board; /* power_fail# line and supercaps of this supervisor */
+    int reboot_pct;
+} micro_supervisor_t;
+
+micro_dev_t *micro_open(int i2cbus, int i2caddr);
+void micro_close(micro_dev_t *dev);
+int micro_bus_lock(int i2cbus);
+void micro_bus_unlock(int lockfd);
+int micro_read(micro_dev_t *dev, uint16_t addr, void *data, size_t size);
+int micro_try_read(micro_dev_t *dev, uint16_t addr, void *data, size_t size);
+int micro_write(micro_dev_t *dev, uint16_t addr, const void *data, size_t size);
+int micro_try_write(micro_dev_t *dev, uint16_t addr, const void *data, size_t size);
 uint16_t swap_endian16(uint16_t value);
 uint32_t swap_endian32(uint32_t value);
 
-#define micro_read8(fd, addr, data) micro_read(fd, addr, (uint8_t *)data, sizeof(uint8_t))
-#define micro_write8(fd, addr, data) micro_write(fd, addr, (uint8_t *)data, sizeof(uint8_t))
+#define micro_read8(dev, addr, data) micro_read(dev, addr, (uint8_t *)data, sizeof(uint8_t))
+#define micro_write8(dev, addr, data) micro_write(dev, addr, (uint8_t *)data, sizeof(uint8_t))
 
-#define micro_read16(fd, addr, data) micro_read(fd, addr, (uint16_t *)data, sizeof(uint16_t))
-#define micro_write16(fd, addr, data) micro_write(fd, addr, (uint16_t *)data, sizeof(uint16_t))
+#define micro_read16(dev, addr, data) micro_read(dev, addr, (uint16_t *)data, sizeof(uint16_t))
+#define micro_write16(dev, addr, data) micro_write(dev, addr, (uint16_t *)data, sizeof(uint16_t))
 
-#define micro_read32(fd, addr, data) micro_read(fd, addr, (uint32_t *)data, sizeof(uint32_t))
-#define micro_write32(fd, addr, data) micro_write(fd, addr, (uint32_t *)data, sizeof(uint32_t))
+#define micro_read32(dev, addr, data) micro_read(dev, addr, (uint32_t *)data, sizeof(uint32_t))
+#define micro_write32(dev, addr, data) micro_write(dev, addr, (uint32_t *)data, sizeof(uint32_t))
 
-int micro_read16_swap(int fd, int addr, uint16_t *data);
-int micro_write16_swap(int fd, int addr, uint16_t *data);
+int micro_read16_swap(micro_dev_t *dev, int addr, uint16_t *data);
+int micro_try_read16_swap(micro_dev_t *dev, int addr, uint16_t *data);
+int micro_write16_swap(micro_dev_t *dev, int addr, uint16_t *data);
 
-int micro_read32_swap(int fd, int addr, uint32_t *data);
-int micro_write32_swap(int fd, int addr, uint32_t *data);
+int micro_read32_swap(micro_dev_t *dev, int addr, uint32_t *data);
+int micro_write32_swap(micro_dev_t *dev, int addr, uint32_t *data);
 
-uint8_t micro_scaps_remaining_pct(int i2cfd, board_t *board);
-void micro_generic_info(int i2cfd, board_t *board);
+int micro_read_snapshot(micro_dev_t *dev, micro_snapshot_t *snap);
+uint8_t micro_scaps_remaining_pct(const micro_snapshot_t *snap);
+uint8_t micro_scaps_mv_pct(uint16_t mv);
+uint8_t micro_scaps_sample_pct(micro_dev_t *dev, micro_snapshot_t *snap);
+int micro_read_info(micro_dev_t *dev, micro_info_t *info);
+void micro_adc_convert(const board_t *board, const micro_snapshot_t *snap, uint32_t *values);
+void micro_generic_info(board_t *board, const micro_info_t *info, FILE *out);
 
-void micro_sleep(int i2cfd, board_t *board, uint32_t seconds);
-void micro_set_charge_current(int i2cfd, board_t *board, uint16_t ma);
-void micro_scaps_en(int i2cfd, board_t *board, int en);
-void micro_scaps_block_pct(int i2cfd, board_t *board, int pct);
-void micro_scaps_monitor_daemon(int i2cfd, board_t *board, int reboot_pct);
+void micro_sleep(micro_dev_t *dev, board_t *board, uint32_t seconds);
+void micro_set_charge_current(micro_dev_t *dev, board_t *board, uint16_t ma);
+void micro_scaps_en(micro_dev_t *dev, board_t *board, int en);
+void micro_scaps_block_pct(micro_dev_t *dev, board_t *board, int pct, struct micro_filter *filter);
+void micro_scaps_monitor_daemon(const micro_supervisor_t *sups, int nsups, const micro_daemon_opts_t *opts);
@@ -0,0 +1,495 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "micro.h"
+#include "micro_sim.h"
+#include "micro_stats.h"
+#include "micro_cache.h"
+#include "micro_watch.h"
+#include "micro_worker.h"
+#include "micro_filter.h"
+#include "micro_replay.h"
+#include "micro_sched.h"
+#include "micro_predict.h"
+#include "micro_shm.h"
+#include "ts7180.h"
+
+/* Benchmarks the library against the simulated micro. Each scenario reports
+ * the transactions, bytes and bus time the simulated micro saw, alongside the
+ * wall time, so that regressions in bus usage show up on any build machine.
+ */
+
+#define BENCH_RUNS 20
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void report(const char *name, int runs, double wall_ms)
+{
+	micro_sim_stats_t stats;
+
+	micro_sim_get_stats(&stats);
+	fprintf(stderr, "%s: %d runs, %.1f transactions/run, %.1f bytes/run, %.2f ms bus/run, %.2f ms wall/run\n",
+		name, runs, (double)stats.transactions / runs, (double)stats.bytes / runs,
+		stats.bus_us / 1000.0 / runs, wall_ms / runs);
+}
+
+/* Same sequence as tsmicroctl --info without a daemon running */
+static void bench_info(micro_dev_t *dev, board_t *board)
+{
+	micro_info_t info;
+	double start;
+
+	start = now_ms();
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		if (micro_read_info(dev, &info) < 0)
+			exit(1);
+		board->info_function(board, &info, stdout);
+	}
+	fflush(stdout);
+	report("info", BENCH_RUNS, now_ms() - start);
+}
+
+/* tsmicroctl --info after an earlier run this boot has filled the cache */
+static void bench_info_cached(micro_dev_t *dev, board_t *board)
+{
+	char path[] = "/tmp/micro_bench.cache";
+	micro_cache_t cache;
+	micro_info_t info;
+	double start;
+
+	micro_cache_load(path, &cache);
+	micro_cache_read_info(&cache, dev, &info);
+	micro_cache_store(path, &cache);
+	micro_sim_reset_stats();
+
+	start = now_ms();
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		micro_cache_load(path, &cache);
+		if (micro_cache_read_info(&cache, dev, &info) < 0)
+			exit(1);
+		board->info_function(board, &info, stdout);
+	}
+	fflush(stdout);
+	report("info-cached", BENCH_RUNS, now_ms() - start);
+	unlink(path);
+}
+
+/* tsmicroctl --wait-pct 80 with the supercaps starting at 46% */
+static void bench_wait_pct(micro_dev_t *dev, board_t *board)
+{
+	double start;
+
+	start = now_ms();
+	micro_scaps_block_pct(dev, board, 80, NULL);
+	report("wait-pct", 1, now_ms() - start);
+}
+
+/* One --daemon sample while power has failed, as the loop handles it: the
+ * snapshot and median filter reads through the bus worker, then the
+ * scheduler, the shutdown prediction and publishing to a shared page. The
+ * page is a scratch file rather than MICRO_SHM_PATH, so a running daemon is
+ * left alone. The loop's own poll() and bookkeeping are not included, they
+ * are static to micro.c.
+ */
+#define BENCH_DAEMON_SHM_PATH "/tmp/micro_bench.shm"
+#define BENCH_DAEMON_TARGET_MV 4000 /* Somewhere below the simulated discharge */
+
+static void bench_daemon_sample(micro_dev_t *dev, board_t *board)
+{
+	micro_worker_t worker;
+	micro_filter_t filter;
+	micro_req_t req = { .dev = dev, .op = MICRO_REQ_SNAPSHOT, .filter = &filter };
+	micro_shm_data_t data = { 0 };
+	micro_shm_page_t *page;
+	micro_sched_t sched;
+	micro_predict_t pred;
+	struct pollfd pfd;
+	int64_t eta_ms;
+	double start;
+
+	page = micro_shm_open(BENCH_DAEMON_SHM_PATH, 1);
+	if (page == NULL) {
+		perror("Failed to open " BENCH_DAEMON_SHM_PATH);
+		exit(1);
+	}
+	micro_filter_init(&filter, MICRO_FILTER_MEDIAN, MICRO_FILTER_DEFAULT_SAMPLES);
+	micro_sched_init(&sched, MICRO_SCHED_MIN_MS, MICRO_SCHED_MAX_MS);
+	micro_predict_reset(&pred);
+	if (micro_worker_start(&worker) < 0) {
+		perror("Failed to start bus worker");
+		exit(1);
+	}
+	pfd.fd = worker.complete_fd;
+	pfd.events = POLLIN;
+
+	start = now_ms();
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		micro_worker_submit(&worker, &req);
+		while (micro_worker_complete(&worker) == NULL)
+			poll(&pfd, 1, -1);
+		if (req.ret < 0) {
+			errno = req.err;
+			perror("Failed to read supervisor registers");
+			exit(1);
+		}
+
+		micro_sched_add(&sched, req.done_ns / 1000000, req.mv);
+		micro_predict_add(&pred, req.done_ns / 1000000, req.mv);
+		micro_predict_ms_to(&pred, BENCH_DAEMON_TARGET_MV);
+		eta_ms = micro_sched_ms_to(&sched, BENCH_DAEMON_TARGET_MV);
+		micro_sched_interval(&sched, eta_ms);
+
+		data.timestamp_ns = req.done_ns;
+		data.scaps_mv = req.snap.adc[MICRO_ADC_CHANNEL(MICRO_ADC_8)];
+		data.scaps_filtered_mv = req.mv;
+		data.scaps_pct = micro_scaps_mv_pct(req.mv);
+		data.status_flags = req.snap.status_flags;
+		data.power_fail = true;
+		micro_shm_publish(page, &data);
+	}
+	report("daemon-sample", BENCH_RUNS, now_ms() - start);
+
+	micro_worker_stop(&worker);
+	micro_shm_close(page);
+	unlink(BENCH_DAEMON_SHM_PATH);
+}
+
+/* Bus cost of one --daemon sample with each filter, to weigh the extra reads
+ * against the noise they remove.
+ */
+static void bench_filter(micro_dev_t *dev, board_t *board)
+{
+	static const struct {
+		const char *name;
+		int type;
+		int samples;
+	} filters[] = {
+		{ "filter-none", MICRO_FILTER_NONE, 1 },
+		{ "filter-median-3", MICRO_FILTER_MEDIAN, 3 },
+		{ "filter-median-5", MICRO_FILTER_MEDIAN, 5 },
+		{ "filter-ema-4", MICRO_FILTER_EMA, 4 },
+	};
+	micro_filter_t filter;
+	micro_snapshot_t snap;
+	double start;
+
+	for (int f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+		micro_filter_init(&filter, filters[f].type, filters[f].samples);
+		micro_sim_reset_stats();
+		start = now_ms();
+		for (int i = 0; i < BENCH_RUNS; i++) {
+			micro_scaps_sample_pct(dev, &snap);
+			micro_filter_sample(&filter, dev, snap.adc[MICRO_ADC_CHANNEL(MICRO_ADC_8)]);
+		}
+		report(filters[f].name, BENCH_RUNS, now_ms() - start);
+	}
+}
+
+/* Cost of the I2C instrumentation per transaction, on a simulated bus with
+ * no latency so the bookkeeping is not lost in the noise.
+ */
+#define BENCH_STATS_RUNS 100000
+
+static void bench_stats(micro_dev_t *dev, board_t *board)
+{
+	micro_snapshot_t snap;
+	double start, off_ms, on_ms;
+
+	micro_stats_enabled = false;
+	start = now_ms();
+	for (int i = 0; i < BENCH_STATS_RUNS; i++)
+		micro_read_snapshot(dev, &snap);
+	off_ms = now_ms() - start;
+
+	micro_stats_enabled = true;
+	start = now_ms();
+	for (int i = 0; i < BENCH_STATS_RUNS; i++)
+		micro_read_snapshot(dev, &snap);
+	on_ms = now_ms() - start;
+
+	fprintf(stderr, "stats-overhead: %d runs, %.1f ns/transaction disabled, %.1f ns/transaction enabled\n",
+		BENCH_STATS_RUNS, off_ms * 1e6 / BENCH_STATS_RUNS, on_ms * 1e6 / BENCH_STATS_RUNS);
+}
+
+/* Round trip of a daemon sample through the bus worker against the same read
+ * made directly, on a simulated bus with no latency.
+ */
+#define BENCH_WORKER_RUNS 100000
+
+static void bench_worker(micro_dev_t *dev, board_t *board)
+{
+	micro_worker_t worker;
+	micro_req_t req = { .dev = dev, .op = MICRO_REQ_SNAPSHOT };
+	struct pollfd pfd;
+	double start, direct_ms, worker_ms;
+
+	if (micro_worker_start(&worker) < 0) {
+		perror("Failed to start bus worker");
+		exit(1);
+	}
+	pfd.fd = worker.complete_fd;
+	pfd.events = POLLIN;
+
+	start = now_ms();
+	for (int i = 0; i < BENCH_WORKER_RUNS; i++)
+		micro_read_snapshot(dev, &req.snap);
+	direct_ms = now_ms() - start;
+
+	start = now_ms();
+	for (int i = 0; i < BENCH_WORKER_RUNS; i++) {
+		micro_worker_submit(&worker, &req);
+		while (micro_worker_complete(&worker) == NULL)
+			poll(&pfd, 1, -1);
+	}
+	worker_ms = now_ms() - start;
+
+	micro_worker_stop(&worker);
+	fprintf(stderr, "worker: %d runs, %.1f us/sample direct, %.1f us/sample through the worker\n",
+		BENCH_WORKER_RUNS, direct_ms * 1e3 / BENCH_WORKER_RUNS, worker_ms * 1e3 / BENCH_WORKER_RUNS);
+}
+
+/* The same round trip with every BENCH_WORKER_FAIL_EVERY-th transfer failing
+ * and a filter making extra reads. Every failed sample has to come back with
+ * its errno rather than take the process down, and the filter has to keep
+ * going on the reads that did succeed.
+ */
+#define BENCH_WORKER_FAIL_RUNS 10000
+#define BENCH_WORKER_FAIL_EVERY 7
+
+static void bench_worker_fail(micro_dev_t *dev, board_t *board)
+{
+	micro_worker_t worker;
+	micro_filter_t filter;
+	micro_req_t req = { .dev = dev, .op = MICRO_REQ_SNAPSHOT, .filter = &filter };
+	micro_req_t *done;
+	struct pollfd pfd;
+	unsigned long failed = 0, bad = 0;
+	double start;
+
+	micro_filter_init(&filter, MICRO_FILTER_EMA, 4);
+	if (micro_worker_start(&worker) < 0) {
+		perror("Failed to start bus worker");
+		exit(1);
+	}
+	pfd.fd = worker.complete_fd;
+	pfd.events = POLLIN;
+
+	micro_sim_config.fail_every = BENCH_WORKER_FAIL_EVERY;
+	start = now_ms();
+	for (int i = 0; i < BENCH_WORKER_FAIL_RUNS; i++) {
+		micro_worker_submit(&worker, &req);
+		while ((done = micro_worker_complete(&worker)) == NULL)
+			poll(&pfd, 1, -1);
+		if (done->ret < 0 && done->err == EIO)
+			failed++;
+		else if (done->ret < 0 || done->mv != micro_sim_config.initial_mv)
+			bad++;
+	}
+	micro_sim_config.fail_every = 0;
+
+	micro_worker_stop(&worker);
+	report("worker-fail", BENCH_WORKER_FAIL_RUNS, now_ms() - start);
+	fprintf(stderr, "worker-fail: %lu of %d samples failed with EIO, %lu came back wrong\n", failed,
+		BENCH_WORKER_FAIL_RUNS, bad);
+	if (bad)
+		exit(1);
+}
+
+/* tsmicroctl --watch 200 for one second. Reports how far behind their
+ * deadlines the samples were taken and how many deadlines were missed.
+ */
+#define BENCH_WATCH_HZ 200
+
+static void bench_watch(micro_dev_t *dev, board_t *board)
+{
+	micro_watch_stats_t stats;
+	double start;
+	FILE *out;
+
+	out = fopen("/dev/null", "w");
+	if (out == NULL) {
+		perror("Failed to open /dev/null");
+		exit(1);
+	}
+
+	start = now_ms();
+	if (micro_watch(dev, board, BENCH_WATCH_HZ, MICRO_WATCH_CSV, BENCH_WATCH_HZ, out, &stats) < 0)
+		exit(1);
+	report("watch", stats.samples, now_ms() - start);
+	fprintf(stderr, "watch: %d Hz, %llu deadlines missed, %.1f us mean and %.1f us max late\n", BENCH_WATCH_HZ,
+		(unsigned long long)stats.missed, stats.late_total_ns / 1000.0 / stats.samples,
+		stats.late_max_ns / 1000.0);
+	fclose(out);
+}
+
+/* Time from exec to exit of one binary, repeated BENCH_RUNS times. Only the
+ * process is measured, there is no simulated micro behind it.
+ */
+static double spawn_ms(char *const args[])
+{
+	posix_spawn_file_actions_t actions;
+	double start, total = 0;
+	pid_t pid;
+	int status;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		start = now_ms();
+		if (posix_spawn(&pid, args[0], &actions, NULL, args, NULL) != 0) {
+			perror("Failed to spawn");
+			exit(1);
+		}
+		waitpid(pid, &status, 0);
+		total += now_ms() - start;
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	return total / BENCH_RUNS;
+}
+
+/* tsmicroctl --record of wait-pct, then --replay of the recording ten times
+ * faster with a median filter, as when trying a filter out on a recording
+ * taken on a unit
+ */
+static void bench_replay(board_t *board)
+{
+	char path[] = "/tmp/micro_bench.replay";
+	micro_replay_header_t header;
+	micro_filter_t filter;
+	micro_dev_t *dev;
+	double start, recorded_ms;
+
+	if (micro_record_start(path, board->compatible, &micro_sim_transport) < 0) {
+		perror("Failed to create recording");
+		exit(1);
+	}
+	micro_set_transport(&micro_record_transport);
+	dev = micro_open(board->i2c_bus, board->i2c_chip);
+	start = now_ms();
+	micro_scaps_block_pct(dev, board, 80, NULL);
+	recorded_ms = now_ms() - start;
+	micro_close(dev);
+
+	if (micro_replay_load(path, 10, &header) < 0) {
+		perror("Failed to load recording");
+		exit(1);
+	}
+	micro_set_transport(&micro_replay_transport);
+	dev = micro_open(board->i2c_bus, board->i2c_chip);
+	micro_filter_init(&filter, MICRO_FILTER_MEDIAN, 5);
+	start = now_ms();
+	micro_scaps_block_pct(dev, board, 80, &filter);
+	fprintf(stderr, "replay: %.2f ms wall recorded, %.2f ms wall replayed at 10x with a 5 sample median\n",
+		recorded_ms, now_ms() - start);
+	unlink(path);
+}
+
+/* Startup cost of tsmicroctl --sleep against tsmicroctl-sleep, which only
+ * means something on a unit. The duration is out of range, so nothing is
+ * written to a micro. tsmicroctl rejects it after loading its libraries,
+ * looking up the board and opening the bus, tsmicroctl-sleep as soon as it
+ * has been loaded. Without a devicetree and the bus, tsmicroctl would time
+ * its own failure to start instead, so the benchmark is skipped.
+ */
+static void bench_sleep_startup(char *tsmicroctl, char *tsmicroctl_sleep)
+{
+	char seconds[16];
+	char *full[] = { tsmicroctl, "--sleep", seconds, NULL };
+	char *sleep[] = { tsmicroctl_sleep, seconds, NULL };
+
+	if (access("/sys/firmware/devicetree/base/compatible", R_OK) < 0 || access("/dev/i2c-0", R_OK | W_OK) < 0) {
+		fprintf(stderr, "sleep-startup: skipped, no devicetree or /dev/i2c-0 to start up against\n");
+		return;
+	}
+
+	snprintf(seconds, sizeof(seconds), "%u", MICRO_SLEEP_MAX_SECONDS + 1);
+	fprintf(stderr, "sleep-startup: %d runs, %.2f ms tsmicroctl --sleep, %.2f ms tsmicroctl-sleep\n",
+		BENCH_RUNS, spawn_ms(full), spawn_ms(sleep));
+}
+
+int main(int argc, char *argv[])
+{
+	board_t board = ts7180_board;
+	micro_dev_t *dev;
+
+	if (argc == 4 && strcmp(argv[1], "sleep-startup") == 0) {
+		bench_sleep_startup(argv[2], argv[3]);
+		return 0;
+	}
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s info|info-cached|wait-pct|daemon-sample|filter|stats|worker|worker-fail|watch|replay|sleep-startup <tsmicroctl> <tsmicroctl-sleep>\n",
+			argv[0]);
+		return 1;
+	}
+
+	/* The simulated micro reports power_fail in its status flags */
+	board.power_fail_bank = NULL;
+
+	if (strcmp(argv[1], "wait-pct") == 0 || strcmp(argv[1], "replay") == 0) {
+		micro_sim_config.initial_mv = 4200;
+		micro_sim_config.time_scale = 10;
+	} else if (strcmp(argv[1], "daemon-sample") == 0) {
+		micro_sim_config.power_fail_ms = 0;
+	} else if (strcmp(argv[1], "stats") == 0 || strcmp(argv[1], "worker") == 0 ||
+		   strcmp(argv[1], "worker-fail") == 0) {
+		micro_sim_config.xfer_latency_us = 0;
+		micro_sim_config.byte_latency_us = 0;
+	}
+
+	/* Results go to stderr, keep the info output out of the way */
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		perror("Failed to redirect stdout");
+		return 1;
+	}
+
+	micro_set_transport(&micro_sim_transport);
+	dev = micro_open(board.i2c_bus, board.i2c_chip);
+	micro_sim_reset_stats();
+
+	if (strcmp(argv[1], "info") == 0) {
+		bench_info(dev, &board);
+	} else if (strcmp(argv[1], "info-cached") == 0) {
+		bench_info_cached(dev, &board);
+	} else if (strcmp(argv[1], "wait-pct") == 0) {
+		bench_wait_pct(dev, &board);
+	} else if (strcmp(argv[1], "daemon-sample") == 0) {
+		bench_daemon_sample(dev, &board);
+	} else if (strcmp(argv[1], "filter") == 0) {
+		bench_filter(dev, &board);
+	} else if (strcmp(argv[1], "stats") == 0) {
+		bench_stats(dev, &board);
+	} else if (strcmp(argv[1], "worker") == 0) {
+		bench_worker(dev, &board);
+	} else if (strcmp(argv[1], "worker-fail") == 0) {
+		bench_worker_fail(dev, &board);
+	} else if (strcmp(argv[1], "watch") == 0) {
+		bench_watch(dev, &board);
+	} else if (strcmp(argv[1], "replay") == 0) {
+		bench_replay(&board);
+	} else {
+		fprintf(stderr, "Unknown benchmark \"%s\"\n", argv[1]);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,120 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "micro.h"
+#include "micro_cache.h"
+
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+
+static int read_boot_id(char *boot_id, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(BOOT_ID_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, boot_id, size - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+
+	boot_id[len] = '\0';
+	boot_id[strcspn(boot_id, "\n")] = '\0';
+	return 0;
+}
+
+/* Returns 0 if path holds a cache from this boot. Otherwise returns -1, with
+ * cache emptied and ready to be filled in and stored for this boot.
+ */
+int micro_cache_load(const char *path, micro_cache_t *cache)
+{
+	micro_cache_t file;
+	ssize_t len = -1;
+	int fd;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->magic = MICRO_CACHE_MAGIC;
+	cache->version = MICRO_CACHE_VERSION;
+	cache->board_index = -1;
+
+	/* Without a boot ID there is no telling whether a cache is stale */
+	if (read_boot_id(cache->boot_id, sizeof(cache->boot_id)) < 0)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, &file, sizeof(file));
+	close(fd);
+
+	if (len != sizeof(file) || file.magic != MICRO_CACHE_MAGIC || file.version != MICRO_CACHE_VERSION ||
+	    strncmp(file.boot_id, cache->boot_id, sizeof(file.boot_id)) != 0)
+		return -1;
+
+	file.build[sizeof(file.build) - 1] = '\0';
+	file.dirty = 0;
+	*cache = file;
+	return 0;
+}
+
+/* Writes the cache if anything changed since it was loaded. Failing to is
+ * not an error for the caller, the next run just reads everything again.
+ */
+int micro_cache_store(const char *path, micro_cache_t *cache)
+{
+	char tmp_path[4096];
+	ssize_t len;
+	int fd;
+
+	if (!cache->dirty || cache->boot_id[0] == '\0')
+		return 0;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	cache->dirty = 0;
+	len = write(fd, cache, sizeof(*cache));
+	close(fd);
+
+	if (len != sizeof(*cache) || rename(tmp_path, path) < 0) {
+		int err = errno;
+
+		unlink(tmp_path);
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* micro_read_info(), taking the revision and build string from the cache
+ * when it has them.
+ */
+int micro_cache_read_info(micro_cache_t *cache, micro_dev_t *dev, micro_info_t *info)
+{
+	if (!cache->have_info) {
+		if (micro_read_info(dev, info) < 0)
+			return -1;
+		cache->revision = info->revision;
+		memcpy(cache->build, info->build, sizeof(cache->build));
+		cache->have_info = 1;
+		cache->dirty = 1;
+		return 0;
+	}
+
+	info->revision = cache->revision;
+	memcpy(info->build, cache->build, sizeof(info->build));
+
+	if (micro_read_snapshot(dev, &info->snap) < 0) {
+		perror("Failed to read supervisor registers");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Per-boot cache of what cannot change while the system is up
+ *
+ * The micro's revision and build string are fixed until it is reflashed,
+ * which only takes effect across a reset of the board, and the board model
+ * never changes. Both are kept in MICRO_CACHE_PATH alongside the boot ID they
+ * were read during, so later invocations in the same boot skip the devicetree
+ * lookup and the revision and build string reads. A cache from any other boot
+ * is ignored.
+ */
+#define MICRO_CACHE_PATH "/run/tsmicroctl.cache"
+#define MICRO_CACHE_MAGIC 0x43435354 /* "TSCC" */
+#define MICRO_CACHE_VERSION 1
+
+typedef struct micro_cache {
+	uint32_t magic;
+	uint32_t version;
+	char boot_id[40];
+	int32_t board_index; /* Index into the board table, -1 if unknown */
+	uint8_t have_info;   /* revision and build are valid */
+	uint8_t revision;
+	char build[80];
+	uint8_t dirty;       /* Changed since loaded, not part of the file */
+} micro_cache_t;
+
+int micro_cache_load(const char *path, micro_cache_t *cache);
+int micro_cache_store(const char *path, micro_cache_t *cache);
+int micro_cache_read_info(micro_cache_t *cache, micro_dev_t *dev, micro_info_t *info);
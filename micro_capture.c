@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "micro_capture.h"
+
+/* Allocates and touches the whole ring up front so that sampling never
+ * takes a page fault. Returns NULL if hz is out of range or on ENOMEM.
+ */
+micro_capture_t *micro_capture_alloc(int hz)
+{
+	micro_capture_t *cap;
+
+	if (hz <= 0 || hz > MICRO_CAPTURE_MAX_HZ) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* Not calloc(): a ring this size comes straight from mmap() as zero
+	 * pages that are only faulted in on first write, which is what the
+	 * explicit memset() is for.
+	 */
+	cap = malloc(sizeof(*cap));
+	if (cap == NULL)
+		return NULL;
+	memset(cap, 0, sizeof(*cap));
+	cap->hz = hz;
+
+	return cap;
+}
+
+void micro_capture_start(micro_capture_t *cap, uint64_t now_ns)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	cap->start_realtime_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	cap->start_ns = now_ns;
+	cap->head = 0;
+	cap->count = 0;
+	cap->missed = 0;
+}
+
+void micro_capture_add(micro_capture_t *cap, uint64_t now_ns, uint16_t mv)
+{
+	micro_capture_sample_t *sample = &cap->samples[cap->head];
+
+	sample->t_us = (now_ns - cap->start_ns) / 1000;
+	sample->mv = mv;
+
+	cap->head = (cap->head + 1) % MICRO_CAPTURE_SAMPLES;
+	if (cap->count < MICRO_CAPTURE_SAMPLES)
+		cap->count++;
+}
+
+/* Writes the capture to a new file in dir, named after the start time of the
+ * event to the millisecond and tag if not NULL, and returns its name in
+ * path. Returns -1 with errno set on failure.
+ */
+int micro_capture_dump(const micro_capture_t *cap, const char *dir, int format, const char *tag, char *path,
+		       size_t path_size)
+{
+	micro_capture_bin_header_t header;
+	uint32_t first = (cap->head + MICRO_CAPTURE_SAMPLES - cap->count) % MICRO_CAPTURE_SAMPLES;
+	time_t start = cap->start_realtime_ns / 1000000000ULL;
+	char stamp[32];
+	struct tm tm;
+	FILE *file;
+	int ret = 0;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	/* Events can come less than a second apart, so whole seconds would let
+	 * one capture overwrite the other
+	 */
+	gmtime_r(&start, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%S", &tm);
+	snprintf(path, path_size, "%s/discharge-%s%s%s.%03uZ.%s", dir, tag ? tag : "", tag ? "-" : "", stamp,
+		 (unsigned)(cap->start_realtime_ns / 1000000 % 1000), format == MICRO_CAPTURE_BIN ? "bin" : "csv");
+
+	file = fopen(path, "w");
+	if (file == NULL)
+		return -1;
+
+	if (format == MICRO_CAPTURE_BIN) {
+		header.magic = MICRO_CAPTURE_BIN_MAGIC;
+		header.version = 1;
+		header.hz = cap->hz;
+		header.start_realtime_ns = cap->start_realtime_ns;
+		header.count = cap->count;
+		header.missed = cap->missed;
+		fwrite(&header, sizeof(header), 1, file);
+	} else {
+		fprintf(file, "t_us,mv\n");
+	}
+
+	for (uint32_t i = 0; i < cap->count; i++) {
+		const micro_capture_sample_t *sample = &cap->samples[(first + i) % MICRO_CAPTURE_SAMPLES];
+
+		if (format == MICRO_CAPTURE_BIN) {
+			fwrite(&sample->t_us, sizeof(sample->t_us), 1, file);
+			fwrite(&sample->mv, sizeof(sample->mv), 1, file);
+		} else {
+			fprintf(file, "%u,%u\n", sample->t_us, sample->mv);
+		}
+	}
+
+	if (ferror(file))
+		ret = -1;
+	if (fclose(file) != 0)
+		ret = -1;
+
+	return ret;
+}
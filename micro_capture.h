@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+/* High rate capture of the supercap voltage during a power fail
+ *
+ * Samples go into a ring preallocated by micro_capture_alloc(), so adding one
+ * never allocates or does I/O. If an event outlasts the ring, the oldest
+ * samples are overwritten so that the end of the discharge is always kept.
+ * The capture is written out with micro_capture_dump() once the event is over.
+ */
+#define MICRO_CAPTURE_SAMPLES 16384
+#define MICRO_CAPTURE_MAX_HZ 1000
+
+#define MICRO_CAPTURE_CSV 0
+#define MICRO_CAPTURE_BIN 1
+
+#define MICRO_CAPTURE_BIN_MAGIC 0x50435354 /* "TSCP" */
+
+typedef struct micro_capture_sample {
+	uint32_t t_us; /* Since micro_capture_start() */
+	uint16_t mv;   /* Raw MICRO_ADC_8 reading */
+} micro_capture_sample_t;
+
+/* Binary dumps are this header followed by count packed 6 byte
+ * { uint32_t t_us; uint16_t mv; } records, all in host byte order.
+ */
+typedef struct __attribute__((packed)) micro_capture_bin_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t hz;
+	uint64_t start_realtime_ns;
+	uint32_t count;
+	uint32_t missed;
+} micro_capture_bin_header_t;
+
+typedef struct micro_capture {
+	int hz;
+	uint64_t start_ns;
+	uint64_t start_realtime_ns;
+	uint32_t head;   /* Next slot to be written */
+	uint32_t count;  /* Valid samples, at most MICRO_CAPTURE_SAMPLES */
+	uint32_t missed; /* Sample times that passed without a sample */
+	micro_capture_sample_t samples[MICRO_CAPTURE_SAMPLES];
+} micro_capture_t;
+
+micro_capture_t *micro_capture_alloc(int hz);
+void micro_capture_start(micro_capture_t *cap, uint64_t now_ns);
+void micro_capture_add(micro_capture_t *cap, uint64_t now_ns, uint16_t mv);
+int micro_capture_dump(const micro_capture_t *cap, const char *dir, int format, const char *tag, char *path,
+		       size_t path_size);
@@ -0,0 +1,79 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "micro.h"
+#include "micro_energy.h"
+
+/* Returns -1 if the board's supercaps are not characterized */
+int micro_energy_init(micro_energy_t *energy, const board_t *board)
+{
+	memset(energy, 0, sizeof(*energy));
+	if (board->scaps_capacitance_mf <= 0 || board->scaps_floor_mv >= MICRO_ENERGY_MAX_MV)
+		return -1;
+
+	energy->capacitance_mf = board->scaps_capacitance_mf;
+	energy->efficiency_pct = board->scaps_efficiency_pct ? board->scaps_efficiency_pct : 100;
+	energy->floor_mv = board->scaps_floor_mv;
+	energy->n = (MICRO_ENERGY_MAX_MV - energy->floor_mv) / MICRO_ENERGY_STEP_MV + 1;
+
+	/* mF * mV^2 is 1e-9 J, so 1e-6 mJ */
+	for (int i = 0; i < energy->n; i++) {
+		uint64_t mv = energy->floor_mv + i * MICRO_ENERGY_STEP_MV;
+		uint64_t floor = energy->floor_mv;
+
+		energy->mj[i] = (uint64_t)energy->capacitance_mf * (mv * mv - floor * floor) / 2 *
+				energy->efficiency_pct / 100 / 1000000;
+	}
+
+	return 0;
+}
+
+/* Usable energy in mJ at mv, 0 at or below the floor */
+uint32_t micro_energy_mj(const micro_energy_t *energy, uint16_t mv)
+{
+	uint32_t offset, i, frac;
+
+	if (mv <= energy->floor_mv || energy->n == 0)
+		return 0;
+
+	offset = mv - energy->floor_mv;
+	i = offset / MICRO_ENERGY_STEP_MV;
+	if (i >= energy->n - 1)
+		return energy->mj[energy->n - 1];
+	frac = offset % MICRO_ENERGY_STEP_MV;
+
+	return energy->mj[i] + (energy->mj[i + 1] - energy->mj[i]) * frac / MICRO_ENERGY_STEP_MV;
+}
+
+/* Share of the usable energy at MICRO_SCAPS_FULL_MV left at mv */
+uint8_t micro_energy_pct(const micro_energy_t *energy, uint16_t mv)
+{
+	uint32_t full = micro_energy_mj(energy, MICRO_SCAPS_FULL_MV);
+	uint32_t mj = micro_energy_mj(energy, mv);
+
+	if (full == 0)
+		return 0;
+	if (mj >= full)
+		return 100;
+	return (uint64_t)mj * 100 / full;
+}
+
+/* Power delivered to the load while the supercaps discharge with V^2 falling
+ * at v2_slope mV^2 per ms, or 0 if they are not discharging.
+ */
+uint32_t micro_energy_load_mw(const micro_energy_t *energy, double v2_slope)
+{
+	if (v2_slope >= 0)
+		return 0;
+
+	/* d(C / 2 * V^2) / dt in mF * mV^2 / ms is 1e-3 mW */
+	return -v2_slope * energy->capacitance_mf / 2 * energy->efficiency_pct / 100 / 1000;
+}
+
+/* Time until the floor at load_mw, or -1 without a load */
+int64_t micro_energy_ms_left(const micro_energy_t *energy, uint16_t mv, uint32_t load_mw)
+{
+	if (load_mw == 0)
+		return -1;
+	return (uint64_t)micro_energy_mj(energy, mv) * 1000 / load_mw;
+}
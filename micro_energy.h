@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "micro.h"
+
+/* Energy left in the supercaps
+ *
+ * micro_scaps_remaining_pct() is linear in voltage, but the energy stored in
+ * the supercaps goes with V^2 and the board draws close to constant power
+ * from them, so that percentage says little about the holdup time left. For
+ * boards that describe their supercaps, the usable energy
+ *
+ *   E = C / 2 * (V^2 - Vfloor^2) * efficiency
+ *
+ * is tabulated once every MICRO_ENERGY_STEP_MV from the floor up, and looked
+ * up with linear interpolation, so each sample costs one multiply. Dividing
+ * by the load gives the time left. The load is measured from how fast V^2
+ * falls during a power fail, see micro_predict_slope().
+ */
+#define MICRO_ENERGY_STEP_MV 16
+#define MICRO_ENERGY_MAX_MV 5120
+#define MICRO_ENERGY_TABLE (MICRO_ENERGY_MAX_MV / MICRO_ENERGY_STEP_MV + 1)
+
+typedef struct micro_energy {
+	int capacitance_mf;
+	int efficiency_pct;
+	uint16_t floor_mv;
+	int n;
+	uint32_t mj[MICRO_ENERGY_TABLE]; /* Usable energy at floor_mv + i * MICRO_ENERGY_STEP_MV */
+} micro_energy_t;
+
+int micro_energy_init(micro_energy_t *energy, const board_t *board);
+uint32_t micro_energy_mj(const micro_energy_t *energy, uint16_t mv);
+uint8_t micro_energy_pct(const micro_energy_t *energy, uint16_t mv);
+uint32_t micro_energy_load_mw(const micro_energy_t *energy, double v2_slope);
+int64_t micro_energy_ms_left(const micro_energy_t *energy, uint16_t mv, uint32_t load_mw);
@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "micro.h"
+#include "micro_filter.h"
+
+static const char *const filter_names[] = {
+	[MICRO_FILTER_NONE] = "none",
+	[MICRO_FILTER_MEDIAN] = "median",
+	[MICRO_FILTER_EMA] = "ema",
+};
+
+int micro_filter_parse(const char *name)
+{
+	for (int i = 0; i < sizeof(filter_names) / sizeof(filter_names[0]); i++) {
+		if (strcmp(name, filter_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+void micro_filter_init(micro_filter_t *filter, int type, int samples)
+{
+	memset(filter, 0, sizeof(*filter));
+	filter->type = type;
+	filter->samples = (type == MICRO_FILTER_NONE) ? 1 : samples;
+}
+
+/* Starts the moving average over from the next sample, e.g. when power
+ * fails and the voltage it was tracking stops holding steady.
+ */
+void micro_filter_reset(micro_filter_t *filter)
+{
+	filter->ema = 0;
+}
+
+/* The burst is at most MICRO_FILTER_MAX_SAMPLES long, so insertion sort */
+static uint16_t median(uint16_t *mv, int n)
+{
+	for (int i = 1; i < n; i++) {
+		uint16_t value = mv[i];
+		int j;
+
+		for (j = i; j > 0 && mv[j - 1] > value; j--)
+			mv[j] = mv[j - 1];
+		mv[j] = value;
+	}
+
+	if (n % 2)
+		return mv[n / 2];
+	return (mv[n / 2 - 1] + mv[n / 2] + 1) / 2;
+}
+
+/* Returns the filtered voltage for a sample whose own MICRO_ADC_8 reading,
+ * just taken, was raw_mv. Extra reads that fail are left out of the burst.
+ */
+uint16_t micro_filter_sample(micro_filter_t *filter, micro_dev_t *dev, uint16_t raw_mv)
+{
+	uint16_t mv[MICRO_FILTER_MAX_SAMPLES];
+	uint32_t sum = raw_mv;
+	uint64_t start_ns;
+	int n = 1;
+
+	if (filter->type == MICRO_FILTER_NONE)
+		return raw_mv;
+
+	mv[0] = raw_mv;
+	start_ns = micro_monotonic_ns();
+	for (int i = 1; i < filter->samples; i++) {
+		if (micro_try_read16_swap(dev, MICRO_ADC_8, &mv[n]) < 0)
+			continue;
+		sum += mv[n];
+		n++;
+	}
+	filter->reads += filter->samples - 1;
+	filter->bus_ns += micro_monotonic_ns() - start_ns;
+
+	if (filter->type == MICRO_FILTER_MEDIAN)
+		return median(mv, n);
+
+	/* Decimate the burst to its mean, then y += (x - y) / 2^shift */
+	sum = ((sum << 8) + n / 2) / n;
+	if (filter->ema == 0)
+		filter->ema = sum;
+	else
+		filter->ema = (int32_t)filter->ema + (((int32_t)sum - (int32_t)filter->ema) >> MICRO_FILTER_EMA_SHIFT);
+	return (filter->ema + 128) >> 8;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "micro.h"
+
+/* Supercap voltage filter
+ *
+ * A reboot decision on a single MICRO_ADC_8 reading can be tripped by one
+ * noisy conversion near the threshold. With a filter, every sample is
+ * followed on the bus by samples - 1 more reads of MICRO_ADC_8 and the
+ * decision is made on the filtered voltage instead. The reading in the
+ * snapshot stays the raw one.
+ *
+ * MICRO_FILTER_MEDIAN takes the median of the burst, which throws out single
+ * outliers without any lag. MICRO_FILTER_EMA averages the burst down to one
+ * value and feeds it into an exponential moving average with a weight of
+ * 1 / 2^MICRO_FILTER_EMA_SHIFT, which also smooths across samples but lags
+ * behind a falling voltage by about 2^MICRO_FILTER_EMA_SHIFT samples. The
+ * daemon resets it when power fails, so the charged voltage from before
+ * does not hold up the average. All of the arithmetic is integer, with the
+ * average kept in 1/256 mV.
+ *
+ * The extra reads and the bus time they took are counted, so the cost of the
+ * filter can be weighed against what it buys.
+ */
+#define MICRO_FILTER_NONE 0
+#define MICRO_FILTER_MEDIAN 1
+#define MICRO_FILTER_EMA 2
+
+#define MICRO_FILTER_MAX_SAMPLES 16
+#define MICRO_FILTER_DEFAULT_SAMPLES 5
+#define MICRO_FILTER_EMA_SHIFT 2
+
+typedef struct micro_filter {
+	int type;
+	int samples;     /* Readings per sample, including the snapshot's */
+	uint32_t ema;    /* mV << 8, 0 until the first sample */
+	uint64_t reads;  /* Extra MICRO_ADC_8 reads made */
+	uint64_t bus_ns; /* Time spent on them */
+} micro_filter_t;
+
+int micro_filter_parse(const char *name);
+void micro_filter_init(micro_filter_t *filter, int type, int samples);
+void micro_filter_reset(micro_filter_t *filter);
+uint16_t micro_filter_sample(micro_filter_t *filter, micro_dev_t *dev, uint16_t raw_mv);
@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "micro.h"
+#include "micro_energy.h"
+#include "micro_metrics.h"
+
+#define METRICS_PREFIX "tsmicroctl_"
+#define METRICS_MAX_GAUGES (16 + MICRO_ADC_MAX_CHANNELS)
+
+/* One numeric --info key of a supervisor */
+typedef struct metrics_gauge {
+	const char *name;
+	long long value;
+} metrics_gauge_t;
+
+static void add_gauge(metrics_gauge_t *gauges, int *count, const char *name, long long value)
+{
+	gauges[*count].name = name;
+	gauges[*count].value = value;
+	(*count)++;
+}
+
+/* Fills gauges with the numeric keys micro_generic_info() prints for the
+ * source, in the same order and under the same names. Returns the count.
+ */
+static int info_gauges(const micro_metrics_source_t *source, metrics_gauge_t *gauges)
+{
+	const micro_snapshot_t *snap = &source->info->snap;
+	const board_t *board = source->board;
+	uint32_t values[MICRO_ADC_MAX_CHANNELS];
+	uint16_t mv = snap->adc[MICRO_ADC_CHANNEL(MICRO_ADC_8)];
+	int count = 0;
+
+	add_gauge(gauges, &count, "micro_revision", source->info->revision);
+	add_gauge(gauges, &count, "micro_startup_celcius", snap->adc[MICRO_ADC_CHANNEL(MICRO_ADC_4)]);
+	add_gauge(gauges, &count, "micro_celcius", snap->adc[MICRO_ADC_CHANNEL(MICRO_ADC_10)]);
+	add_gauge(gauges, &count, "usb_present", !!(snap->status_flags & MICRO_STATUS_FLAGS_USB_PRESENT));
+
+	if (board->has_silo) {
+		add_gauge(gauges, &count, "power_fail", !!(snap->status_flags & MICRO_STATUS_FLAGS_POWER_FAIL));
+		add_gauge(gauges, &count, "scaps_enabled", !!(snap->status_flags & MICRO_STATUS_FLAGS_SCAPS_EN));
+		add_gauge(gauges, &count, "scaps_met_min", !!(snap->status_flags & MICRO_STATUS_FLAGS_SCAPS_MET_MIN));
+		add_gauge(gauges, &count, "scaps_charging",
+			  !!(snap->status_flags & MICRO_STATUS_FLAGS_SCAPS_CHARGING));
+		add_gauge(gauges, &count, "supercaps_remaining_pct", micro_scaps_remaining_pct(snap));
+		if (source->energy) {
+			add_gauge(gauges, &count, "supercaps_energy_mj", micro_energy_mj(source->energy, mv));
+			add_gauge(gauges, &count, "supercaps_energy_pct", micro_energy_pct(source->energy, mv));
+		}
+		add_gauge(gauges, &count, "supercaps_charge_current_ma", snap->charge_current);
+		add_gauge(gauges, &count, "supercaps_charge_current_default_ma", snap->charge_current_default);
+	}
+
+	micro_adc_convert(board, snap, values);
+	for (int i = 0; i < board->adc_nchannels; i++)
+		add_gauge(gauges, &count, board->adc_channels[i].name, values[i]);
+
+	return count;
+}
+
+/* Returns the gauge called name, or NULL if the supervisor has none */
+static const metrics_gauge_t *find_gauge(const metrics_gauge_t *gauges, int count, const char *name)
+{
+	for (int i = 0; i < count; i++) {
+		if (strcmp(gauges[i].name, name) == 0)
+			return &gauges[i];
+	}
+	return NULL;
+}
+
+/* Label values may not contain raw backslashes, quotes or newlines */
+static void write_label_value(FILE *file, const char *value)
+{
+	size_t len = strlen(value);
+
+	for (size_t i = 0; i < len; i++) {
+		if (value[i] == '\\' || value[i] == '"')
+			fputc('\\', file);
+		fputc(value[i], file);
+	}
+}
+
+static void write_sample_start(FILE *file, const char *name, const micro_metrics_source_t *source)
+{
+	fprintf(file, METRICS_PREFIX "%s{supervisor=\"", name);
+	write_label_value(file, source->name);
+	fputc('"', file);
+}
+
+/* Writes the --info keys as metrics. All samples of a metric have to be
+ * grouped together, so each gauge is written out for every supervisor the
+ * first time it is seen.
+ */
+static void write_info_metrics(FILE *file, const micro_metrics_source_t *sources, int nsources)
+{
+	metrics_gauge_t gauges[nsources][METRICS_MAX_GAUGES];
+	const metrics_gauge_t *gauge;
+	int counts[nsources];
+	bool seen;
+
+	for (int s = 0; s < nsources; s++)
+		counts[s] = info_gauges(&sources[s], gauges[s]);
+
+	for (int s = 0; s < nsources; s++) {
+		for (int i = 0; i < counts[s]; i++) {
+			const char *name = gauges[s][i].name;
+
+			seen = false;
+			for (int prev = 0; prev < s && !seen; prev++)
+				seen = find_gauge(gauges[prev], counts[prev], name) != NULL;
+			if (seen)
+				continue;
+
+			fprintf(file, "# TYPE " METRICS_PREFIX "%s gauge\n", name);
+			for (int t = s; t < nsources; t++) {
+				gauge = find_gauge(gauges[t], counts[t], name);
+				if (gauge == NULL)
+					continue;
+				write_sample_start(file, name, &sources[t]);
+				fprintf(file, "} %lld\n", gauge->value);
+			}
+		}
+	}
+
+	fprintf(file, "# HELP " METRICS_PREFIX "info Supervisory microcontroller firmware\n");
+	fprintf(file, "# TYPE " METRICS_PREFIX "info gauge\n");
+	for (int s = 0; s < nsources; s++) {
+		write_sample_start(file, "info", &sources[s]);
+		fprintf(file, ",micro_build=\"");
+		write_label_value(file, sources[s].info->build);
+		fprintf(file, "\"} 1\n");
+	}
+}
+
+#define COUNTER_ULONG 0
+#define COUNTER_DOUBLE 1
+#define COUNTER_U16 2
+
+/* Counters kept by the daemon, in the order they are written */
+#define COUNTER(field, kind) offsetof(micro_metrics_t, field), kind
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t offset; /* Of the value in micro_metrics_t */
+	int kind;      /* COUNTER_*, the type of the value */
+} counters[] = {
+	{ "power_fail_events_total", "counter", "power_fail# assertions seen since the daemon started",
+	  COUNTER(power_fail_events, COUNTER_ULONG) },
+	{ "power_fail_restored_total", "counter", "Power fails ridden through until power returned",
+	  COUNTER(power_fail_restored, COUNTER_ULONG) },
+	{ "holdup_seconds_total", "counter", "Time spent running from the supercaps over power fails ridden through",
+	  COUNTER(holdup_total_s, COUNTER_DOUBLE) },
+	{ "holdup_max_seconds", "gauge", "Longest power fail ridden through", COUNTER(holdup_max_s, COUNTER_DOUBLE) },
+	{ "holdup_last_seconds", "gauge", "Most recent power fail ridden through",
+	  COUNTER(holdup_last_s, COUNTER_DOUBLE) },
+	{ "bus_errors_total", "counter", "Samples the supervisor failed to answer", COUNTER(bus_errors, COUNTER_ULONG) },
+	{ "bus_timeouts_total", "counter", "Samples the supervisor was slow to answer",
+	  COUNTER(bus_timeouts, COUNTER_ULONG) },
+	{ "supercap_filtered_mv", "gauge", "Filtered supercap voltage the reboot decision is made on",
+	  COUNTER(scaps_filtered_mv, COUNTER_U16) },
+	{ "filter_reads_total", "counter", "Extra supercap voltage reads made by the filter",
+	  COUNTER(filter_reads, COUNTER_ULONG) },
+	{ "filter_bus_seconds_total", "counter", "Bus time spent on the filter's extra reads",
+	  COUNTER(filter_bus_s, COUNTER_DOUBLE) },
+	{ "load_watts", "gauge", "Load on the supercaps measured during the latest power fail",
+	  COUNTER(load_w, COUNTER_DOUBLE) },
+	{ "holdup_remaining_seconds", "gauge", "Estimated holdup time left at the load of the latest power fail",
+	  COUNTER(holdup_s, COUNTER_DOUBLE) },
+};
+
+static double counter_value(const micro_metrics_t *metrics, int counter)
+{
+	const char *value = (const char *)metrics + counters[counter].offset;
+
+	switch (counters[counter].kind) {
+	case COUNTER_ULONG:
+		return *(const unsigned long *)value;
+	case COUNTER_U16:
+		return *(const uint16_t *)value;
+	default:
+		return *(const double *)value;
+	}
+}
+
+static void write_counters(FILE *file, const micro_metrics_source_t *sources, int nsources)
+{
+	for (int c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+		fprintf(file, "# HELP " METRICS_PREFIX "%s %s\n", counters[c].name, counters[c].help);
+		fprintf(file, "# TYPE " METRICS_PREFIX "%s %s\n", counters[c].name, counters[c].type);
+		for (int s = 0; s < nsources; s++) {
+			write_sample_start(file, counters[c].name, &sources[s]);
+			fprintf(file, "} %g\n", counter_value(sources[s].metrics, c));
+		}
+	}
+}
+
+/* Returns 0 once path has been replaced, or -1 with errno set */
+int micro_metrics_write(const char *path, const micro_metrics_source_t *sources, int nsources)
+{
+	char tmp_path[4096];
+	FILE *file;
+	int ret = 0;
+	int err;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	file = fopen(tmp_path, "w");
+	if (file == NULL)
+		return -1;
+
+	write_info_metrics(file, sources, nsources);
+	write_counters(file, sources, nsources);
+
+	if (ferror(file))
+		ret = -1;
+	if (fclose(file) != 0)
+		ret = -1;
+	if (ret == 0 && rename(tmp_path, path) < 0)
+		ret = -1;
+	if (ret < 0) {
+		err = errno;
+		unlink(tmp_path);
+		errno = err;
+	}
+
+	return ret;
+}
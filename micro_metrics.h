@@ -0,0 +1,36 @@
+#pragma once
+
+/* node_exporter textfile written by the daemon
+ *
+ * Every numeric key that micro_generic_info() prints for --info becomes a
+ * gauge named tsmicroctl_<key>, built straight from the snapshot and the
+ * board's ADC table, and the build string becomes a label on tsmicroctl_info.
+ * Power fail counters kept by the daemon are appended. Every sample
+ * carries a supervisor label, so one file covers all the supervisors a daemon
+ * watches. The file is written next to its final path and renamed over it, so
+ * a scrape never sees a partial file and never causes bus traffic.
+ */
+typedef struct micro_metrics {
+	unsigned long power_fail_events;   /* power_fail# assertions seen */
+	unsigned long power_fail_restored; /* Of those, ridden through until power returned */
+	double holdup_total_s;             /* Time spent on the supercaps over restored events */
+	double holdup_max_s;
+	double holdup_last_s;
+	unsigned long bus_errors;          /* Samples that failed after retries in the transfer */
+	unsigned long bus_timeouts;        /* Samples still outstanding at the bus timeout */
+	uint16_t scaps_filtered_mv;        /* Supercap voltage the daemon decides on */
+	unsigned long filter_reads;        /* Extra MICRO_ADC_8 reads made by the filter */
+	double filter_bus_s;               /* Bus time they took */
+	double load_w;                     /* Load measured during the latest power fail, NaN if none */
+	double holdup_s;                   /* Holdup time left at that load, NaN if not known */
+} micro_metrics_t;
+
+typedef struct micro_metrics_source {
+	const char *name; /* supervisor label */
+	board_t *board;
+	const micro_info_t *info;
+	const struct micro_energy *energy; /* NULL without an energy model */
+	const micro_metrics_t *metrics;
+} micro_metrics_source_t;
+
+int micro_metrics_write(const char *path, const micro_metrics_source_t *sources, int nsources);
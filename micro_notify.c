@@ -0,0 +1,67 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef HAVE_LIBSYSTEMD
+#include <systemd/sd-daemon.h>
+#endif
+
+#include "micro_notify.h"
+
+#ifdef HAVE_LIBSYSTEMD
+
+uint64_t micro_notify_init(void)
+{
+	uint64_t usec = 0;
+
+	if (sd_watchdog_enabled(0, &usec) <= 0)
+		return 0;
+	return usec;
+}
+
+void micro_notify(const char *state)
+{
+	sd_notify(0, state);
+}
+
+#else
+
+static int notify_fd = -1;
+static struct sockaddr_un notify_addr;
+static socklen_t notify_len;
+
+uint64_t micro_notify_init(void)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	const char *usec = getenv("WATCHDOG_USEC");
+	const char *pid = getenv("WATCHDOG_PID");
+	size_t len;
+
+	if (path && (path[0] == '/' || path[0] == '@') && (len = strlen(path)) < sizeof(notify_addr.sun_path)) {
+		notify_addr.sun_family = AF_UNIX;
+		memcpy(notify_addr.sun_path, path, len);
+		/* Abstract namespace */
+		if (path[0] == '@')
+			notify_addr.sun_path[0] = '\0';
+		notify_len = offsetof(struct sockaddr_un, sun_path) + len;
+		notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	}
+
+	if (notify_fd < 0 || usec == NULL)
+		return 0;
+	/* The watchdog may be meant for another process of the service */
+	if (pid && strtol(pid, NULL, 10) != getpid())
+		return 0;
+	return strtoull(usec, NULL, 10);
+}
+
+void micro_notify(const char *state)
+{
+	if (notify_fd >= 0)
+		sendto(notify_fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&notify_addr, notify_len);
+}
+
+#endif
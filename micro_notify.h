@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Service manager notifications
+ *
+ * Speaks the sd_notify() protocol when the daemon runs as a Type=notify
+ * service: through libsystemd when built with it, and otherwise by sending
+ * the datagram to $NOTIFY_SOCKET directly, which is all sd_notify() does.
+ * Outside of systemd both calls do nothing.
+ *
+ * micro_notify_init() returns the interval in us that systemd expects
+ * "WATCHDOG=1" within, or 0 if the service has no watchdog.
+ */
+uint64_t micro_notify_init(void);
+void micro_notify(const char *state);
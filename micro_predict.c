@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "micro_predict.h"
+
+void micro_predict_reset(micro_predict_t *pred)
+{
+	memset(pred, 0, sizeof(*pred));
+}
+
+void micro_predict_add(micro_predict_t *pred, uint64_t t_ms, uint16_t mv)
+{
+	pred->t_ms[pred->head] = t_ms;
+	pred->mv[pred->head] = mv;
+	pred->head = (pred->head + 1) % MICRO_PREDICT_WINDOW;
+	if (pred->count < MICRO_PREDICT_WINDOW)
+		pred->count++;
+}
+
+/* Fits the line to V^2 over the window. Returns -1 if there are too few
+ * samples, otherwise the slope in mV^2 per ms and the value of the line at
+ * the newest sample.
+ */
+static int predict_fit(const micro_predict_t *pred, double *slope, double *fit)
+{
+	int newest = (pred->head + MICRO_PREDICT_WINDOW - 1) % MICRO_PREDICT_WINDOW;
+	double st = 0, sy = 0, stt = 0, sty = 0;
+	double n = pred->count;
+
+	if (pred->count < MICRO_PREDICT_MIN_SAMPLES)
+		return -1;
+
+	/* Times are taken relative to the newest sample to keep the sums small */
+	for (int i = 0; i < pred->count; i++) {
+		double t = (double)pred->t_ms[i] - (double)pred->t_ms[newest];
+		double y = (double)pred->mv[i] * pred->mv[i];
+
+		st += t;
+		sy += y;
+		stt += t * t;
+		sty += t * y;
+	}
+
+	if (n * stt - st * st == 0)
+		return -1;
+
+	*slope = (n * sty - st * sy) / (n * stt - st * st);
+	/* Value of the fitted line at the newest sample, t = 0 */
+	*fit = (sy - *slope * st) / n;
+	return 0;
+}
+
+/* Returns the estimated ms from the newest sample until the supercaps fall to
+ * empty_mv, 0 if they already have, or -1 if there are too few samples or
+ * the supercaps are not discharging.
+ */
+int64_t micro_predict_ms_to(const micro_predict_t *pred, uint16_t empty_mv)
+{
+	double slope, fit, empty;
+
+	/* mV^2 per ms, negative while discharging */
+	if (predict_fit(pred, &slope, &fit) < 0 || slope >= 0)
+		return -1;
+
+	empty = (double)empty_mv * empty_mv;
+	if (fit <= empty)
+		return 0;
+
+	return (int64_t)((fit - empty) / -slope);
+}
+
+/* Returns the fitted rate of change of V^2 in mV^2 per ms, which is
+ * proportional to the power drawn from the supercaps, or 0 if there are too
+ * few samples.
+ */
+double micro_predict_slope(const micro_predict_t *pred)
+{
+	double slope, fit;
+
+	if (predict_fit(pred, &slope, &fit) < 0)
+		return 0;
+	return slope;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Online estimate of the time left until the supercaps are empty
+ *
+ * The load on the supercaps during a power fail is close to constant power,
+ * so V^2 rather than V falls linearly with time. A least squares line is
+ * fitted to V^2 over the most recent MICRO_PREDICT_WINDOW samples and
+ * extrapolated down to the empty voltage.
+ */
+#define MICRO_PREDICT_WINDOW 16
+#define MICRO_PREDICT_MIN_SAMPLES 4
+
+typedef struct micro_predict {
+	int head;
+	int count;
+	uint64_t t_ms[MICRO_PREDICT_WINDOW];
+	uint16_t mv[MICRO_PREDICT_WINDOW];
+} micro_predict_t;
+
+void micro_predict_reset(micro_predict_t *pred);
+void micro_predict_add(micro_predict_t *pred, uint64_t t_ms, uint16_t mv);
+int64_t micro_predict_ms_to(const micro_predict_t *pred, uint16_t empty_mv);
+double micro_predict_slope(const micro_predict_t *pred);
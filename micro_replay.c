@@ -0,0 +1,470 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/i2c.h>
+
+#include "micro.h"
+#include "micro_replay.h"
+
+/* Transactions with more messages than this are passed through unrecorded */
+#define RECORD_MAX_MSGS 8
+
+#define REG_SPACE 0x10000
+
+/* Big endian ADC words from MICRO_ADC_0 up to the status flags */
+#define ADC_WORDS (MICRO_STATUS_FLAGS / 2)
+
+static struct {
+	const micro_transport_t *inner;
+	int fd;
+	uint64_t start_ns;
+	struct {
+		int fd;
+		uint8_t bus;
+		uint8_t addr;
+	} devs[MICRO_REPLAY_MAX_DEVS];
+	int ndevs;
+} record = { .fd = -1 };
+
+struct replay_point {
+	uint64_t t_us;
+	uint16_t value;
+};
+
+struct replay_dev {
+	uint8_t bus;
+	uint8_t addr;
+	int fd;
+	uint8_t image[REG_SPACE];
+	uint8_t seeded[REG_SPACE / 8]; /* Registers already in image while loading */
+	struct replay_point *adc[ADC_WORDS]; /* Every recorded reading of each word */
+	size_t adc_count[ADC_WORDS];
+	size_t adc_next[ADC_WORDS]; /* First reading after the replay clock */
+};
+
+static struct {
+	uint8_t *data; /* The whole recording */
+	size_t size;   /* Up to the end of the last complete record */
+	size_t pos;    /* Next record to apply */
+	uint64_t first_us;
+	uint64_t last_us;
+	uint64_t start_ns; /* When the first supervisor was opened, 0 before */
+	int speed;
+	bool ended;
+	struct replay_dev *devs[MICRO_REPLAY_MAX_DEVS];
+	int ndevs;
+	pthread_mutex_t lock;
+} replay = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Starts a recording at path, of transactions carried by inner. Returns -1
+ * with errno set if the recording cannot be created.
+ */
+int micro_record_start(const char *path, const char *compatible, const micro_transport_t *inner)
+{
+	micro_replay_header_t header;
+	struct timespec ts;
+
+	record.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (record.fd < 0)
+		return -1;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memset(&header, 0, sizeof(header));
+	header.magic = MICRO_REPLAY_MAGIC;
+	header.version = MICRO_REPLAY_VERSION;
+	header.realtime_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	snprintf(header.compatible, sizeof(header.compatible), "%s", compatible);
+	if (write(record.fd, &header, sizeof(header)) != sizeof(header)) {
+		close(record.fd);
+		record.fd = -1;
+		return -1;
+	}
+
+	record.inner = inner;
+	record.start_ns = micro_monotonic_ns();
+	return 0;
+}
+
+static int micro_record_open(int i2cbus, int i2caddr)
+{
+	int fd;
+
+	fd = record.inner->open(i2cbus, i2caddr);
+	if (record.ndevs < MICRO_REPLAY_MAX_DEVS) {
+		record.devs[record.ndevs].fd = fd;
+		record.devs[record.ndevs].bus = i2cbus;
+		record.devs[record.ndevs].addr = i2caddr;
+		record.ndevs++;
+	}
+
+	return fd;
+}
+
+/* Each transaction goes out in a single writev() so the worker thread and the
+ * shutdown path never interleave their records.
+ */
+static int micro_record_transfer(int fd, struct i2c_msg *msgs, int nmsgs)
+{
+	micro_replay_record_t rec = { .bus = 0xff, .addr = 0xff };
+	micro_replay_msg_t hdrs[RECORD_MAX_MSGS];
+	struct iovec iov[1 + 2 * RECORD_MAX_MSGS];
+	int ret, err;
+
+	rec.t_us = (micro_monotonic_ns() - record.start_ns) / 1000;
+	ret = record.inner->transfer(fd, msgs, nmsgs);
+	err = errno;
+
+	if (nmsgs > RECORD_MAX_MSGS)
+		return ret;
+
+	for (int i = 0; i < record.ndevs; i++) {
+		if (record.devs[i].fd == fd) {
+			rec.bus = record.devs[i].bus;
+			rec.addr = record.devs[i].addr;
+		}
+	}
+	rec.nmsgs = nmsgs;
+	rec.err = (ret < 0) ? err : 0;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	for (int i = 0; i < nmsgs; i++) {
+		hdrs[i].read = !!(msgs[i].flags & I2C_M_RD);
+		hdrs[i].len = msgs[i].len;
+		iov[1 + 2 * i].iov_base = &hdrs[i];
+		iov[1 + 2 * i].iov_len = sizeof(hdrs[i]);
+		iov[2 + 2 * i].iov_base = msgs[i].buf;
+		iov[2 + 2 * i].iov_len = msgs[i].len;
+	}
+	/* A recording that runs out of space is no reason to fail the bus */
+	if (writev(record.fd, iov, 1 + 2 * nmsgs) < 0)
+		perror("Failed to record transaction");
+
+	errno = err;
+	return ret;
+}
+
+const micro_transport_t micro_record_transport = {
+	.name = "record",
+	.open = micro_record_open,
+	.transfer = micro_record_transfer,
+};
+
+/* Returns the size of the record at pos, or 0 if it is cut short */
+static size_t record_size(size_t pos)
+{
+	const micro_replay_record_t *rec;
+	micro_replay_msg_t msg;
+	size_t size;
+
+	if (replay.size - pos < sizeof(*rec))
+		return 0;
+	rec = (const micro_replay_record_t *)(replay.data + pos);
+	size = sizeof(*rec);
+
+	for (int i = 0; i < rec->nmsgs; i++) {
+		if (replay.size - pos - size < sizeof(msg))
+			return 0;
+		memcpy(&msg, replay.data + pos + size, sizeof(msg));
+		size += sizeof(msg);
+		if (replay.size - pos - size < msg.len)
+			return 0;
+		size += msg.len;
+	}
+
+	return size;
+}
+
+static struct replay_dev *replay_dev(uint8_t bus, uint8_t addr)
+{
+	for (int i = 0; i < replay.ndevs; i++) {
+		if (replay.devs[i]->bus == bus && replay.devs[i]->addr == addr)
+			return replay.devs[i];
+	}
+	return NULL;
+}
+
+/* Copies what the record at pos shows of the registers into their images.
+ * With seed, registers already seeded are left alone, so that after one pass
+ * over the recording each image holds its earliest recorded values.
+ */
+static void apply_record(size_t pos, bool seed)
+{
+	const micro_replay_record_t *rec = (const micro_replay_record_t *)(replay.data + pos);
+	const uint8_t *p = replay.data + pos + sizeof(*rec);
+	struct replay_dev *dev;
+	micro_replay_msg_t msg;
+	uint16_t reg = 0;
+
+	dev = replay_dev(rec->bus, rec->addr);
+	if (rec->err || dev == NULL)
+		return;
+
+	for (int i = 0; i < rec->nmsgs; i++) {
+		const uint8_t *buf;
+		int j = 0;
+
+		memcpy(&msg, p, sizeof(msg));
+		buf = p + sizeof(msg);
+		p += sizeof(msg) + msg.len;
+
+		if (!msg.read) {
+			if (msg.len < 2)
+				return;
+			reg = (buf[0] << 8) | buf[1];
+			j = 2;
+		}
+		for (; j < msg.len; j++, reg++) {
+			if (seed) {
+				if (dev->seeded[reg / 8] & (1 << (reg % 8)))
+					continue;
+				dev->seeded[reg / 8] |= 1 << (reg % 8);
+			}
+			dev->image[reg] = buf[j];
+		}
+	}
+}
+
+/* Adds the ADC words read by the record at pos to their readings */
+static int collect_adc(size_t pos)
+{
+	const micro_replay_record_t *rec = (const micro_replay_record_t *)(replay.data + pos);
+	const uint8_t *p = replay.data + pos + sizeof(*rec);
+	struct replay_point *points;
+	struct replay_dev *dev;
+	micro_replay_msg_t msg;
+	uint16_t reg = 0;
+
+	dev = replay_dev(rec->bus, rec->addr);
+	if (rec->err || dev == NULL)
+		return 0;
+
+	for (int i = 0; i < rec->nmsgs; i++) {
+		const uint8_t *buf;
+
+		memcpy(&msg, p, sizeof(msg));
+		buf = p + sizeof(msg);
+		p += sizeof(msg) + msg.len;
+
+		if (!msg.read) {
+			if (msg.len < 2)
+				return 0;
+			reg = (buf[0] << 8) | buf[1];
+			continue;
+		}
+		for (int w = 0; w < ADC_WORDS; w++) {
+			if (w * 2 < reg || w * 2 + 1 >= reg + msg.len)
+				continue;
+			points = realloc(dev->adc[w], (dev->adc_count[w] + 1) * sizeof(*points));
+			if (points == NULL)
+				return -1;
+			points[dev->adc_count[w]].t_us = rec->t_us;
+			points[dev->adc_count[w]].value = (buf[w * 2 - reg] << 8) | buf[w * 2 + 1 - reg];
+			dev->adc[w] = points;
+			dev->adc_count[w]++;
+		}
+		reg += msg.len;
+	}
+
+	return 0;
+}
+
+/* Loads the recording at path to be served by micro_replay_transport at
+ * speed times the rate it was recorded. A recording cut short by the unit
+ * losing power is replayed up to its last complete transaction. Returns -1
+ * with errno set if path cannot be read or is not a recording.
+ */
+int micro_replay_load(const char *path, int speed, micro_replay_header_t *header)
+{
+	const micro_replay_record_t *rec;
+	struct stat st;
+	size_t pos, size;
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (replay.data = malloc(st.st_size + 1)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	for (pos = 0; pos < st.st_size; pos += len) {
+		len = read(fd, replay.data + pos, st.st_size - pos);
+		if (len <= 0)
+			break;
+	}
+	close(fd);
+
+	if (pos >= sizeof(*header))
+		memcpy(header, replay.data, sizeof(*header));
+	if (pos < sizeof(*header) || header->magic != MICRO_REPLAY_MAGIC ||
+	    header->version != MICRO_REPLAY_VERSION) {
+		free(replay.data);
+		errno = EINVAL;
+		return -1;
+	}
+	header->compatible[sizeof(header->compatible) - 1] = '\0';
+	replay.size = pos;
+
+	/* Every supervisor in the recording gets an image, seeded in one pass */
+	for (pos = sizeof(*header); (size = record_size(pos)) != 0; pos += size) {
+		rec = (const micro_replay_record_t *)(replay.data + pos);
+		if (pos == sizeof(*header))
+			replay.first_us = rec->t_us;
+		replay.last_us = rec->t_us;
+		if (replay_dev(rec->bus, rec->addr) == NULL && replay.ndevs < MICRO_REPLAY_MAX_DEVS) {
+			replay.devs[replay.ndevs] = calloc(1, sizeof(struct replay_dev));
+			if (replay.devs[replay.ndevs] == NULL)
+				return -1;
+			replay.devs[replay.ndevs]->bus = rec->bus;
+			replay.devs[replay.ndevs]->addr = rec->addr;
+			replay.devs[replay.ndevs]->fd = -1;
+			replay.ndevs++;
+		}
+		apply_record(pos, true);
+		if (collect_adc(pos) < 0)
+			return -1;
+	}
+	replay.size = pos;
+	replay.pos = sizeof(*header);
+	replay.speed = speed;
+
+	return 0;
+}
+
+static int micro_replay_open(int i2cbus, int i2caddr)
+{
+	struct replay_dev *dev;
+
+	dev = replay_dev(i2cbus, i2caddr);
+	if (dev == NULL) {
+		fprintf(stderr, "Supervisor %d:0x%02x is not in the recording\n", i2cbus, i2caddr);
+		exit(1);
+	}
+
+	/* Nothing is ever done with the fd, it only has to be valid */
+	dev->fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	if (dev->fd == -1) {
+		perror("Couldn't open replayed micro");
+		exit(1);
+	}
+
+	pthread_mutex_lock(&replay.lock);
+	if (replay.start_ns == 0)
+		replay.start_ns = micro_monotonic_ns();
+	pthread_mutex_unlock(&replay.lock);
+
+	return dev->fd;
+}
+
+/* Sets each ADC word to the straight line between the recorded readings on
+ * either side of t_us, or the nearest one before the first or after the last.
+ */
+static void interpolate_adc(struct replay_dev *dev, uint64_t t_us)
+{
+	for (int w = 0; w < ADC_WORDS; w++) {
+		const struct replay_point *points = dev->adc[w];
+		size_t n = dev->adc_count[w];
+		size_t i = dev->adc_next[w];
+		int64_t value;
+
+		if (n == 0)
+			continue;
+		while (i < n && points[i].t_us <= t_us)
+			i++;
+		dev->adc_next[w] = i;
+
+		if (i == 0) {
+			value = points[0].value;
+		} else if (i == n) {
+			value = points[n - 1].value;
+		} else {
+			value = points[i - 1].value;
+			value += ((int64_t)points[i].value - points[i - 1].value) * (int64_t)(t_us - points[i - 1].t_us) /
+				 (int64_t)(points[i].t_us - points[i - 1].t_us);
+		}
+		dev->image[w * 2] = value >> 8;
+		dev->image[w * 2 + 1] = value & 0xff;
+	}
+}
+
+/* Brings every image up to the replay clock. Called with replay.lock held. */
+static void advance(void)
+{
+	const micro_replay_record_t *rec;
+	uint64_t t_us;
+
+	t_us = replay.first_us + (micro_monotonic_ns() - replay.start_ns) / 1000 * replay.speed;
+
+	while (replay.pos < replay.size) {
+		rec = (const micro_replay_record_t *)(replay.data + replay.pos);
+		if (rec->t_us > t_us)
+			break;
+		apply_record(replay.pos, false);
+		replay.pos += record_size(replay.pos);
+	}
+	for (int i = 0; i < replay.ndevs; i++)
+		interpolate_adc(replay.devs[i], t_us);
+
+	if (!replay.ended && t_us > replay.last_us + MICRO_REPLAY_TAIL_MS * 1000ULL) {
+		replay.ended = true;
+		fprintf(stderr, "Replay finished\n");
+		kill(getpid(), SIGTERM);
+	}
+}
+
+static int micro_replay_transfer(int fd, struct i2c_msg *msgs, int nmsgs)
+{
+	struct replay_dev *dev = NULL;
+	uint16_t reg = 0;
+
+	for (int i = 0; i < replay.ndevs; i++) {
+		if (replay.devs[i]->fd == fd)
+			dev = replay.devs[i];
+	}
+	if (dev == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	pthread_mutex_lock(&replay.lock);
+	advance();
+
+	for (int i = 0; i < nmsgs; i++) {
+		struct i2c_msg *msg = &msgs[i];
+
+		if (msg->flags & I2C_M_RD) {
+			for (int j = 0; j < msg->len; j++)
+				msg->buf[j] = dev->image[reg++];
+		} else {
+			if (msg->len < 2) {
+				pthread_mutex_unlock(&replay.lock);
+				errno = EINVAL;
+				return -1;
+			}
+			reg = (msg->buf[0] << 8) | msg->buf[1];
+			for (int j = 2; j < msg->len; j++)
+				dev->image[reg++] = msg->buf[j];
+		}
+	}
+	pthread_mutex_unlock(&replay.lock);
+
+	return nmsgs;
+}
+
+const micro_transport_t micro_replay_transport = {
+	.name = "replay",
+	.open = micro_replay_open,
+	.transfer = micro_replay_transfer,
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Recording and replay of supervisor bus traffic
+ *
+ * micro_record_transport passes every transaction through to another
+ * transport and appends it to a recording: when it started, which supervisor
+ * it went to, whether it failed, and every message with the bytes written or
+ * read back. Retries are separate transactions, so a recording taken during a
+ * power fail test on a unit keeps the bus exactly as the daemon saw it.
+ *
+ * micro_replay_transport serves a recording back. Rather than insisting on
+ * the same sequence of transactions, it keeps an image of each supervisor's
+ * registers and moves it forward along the recording's timeline, as scaled by
+ * speed, before every transfer. The ADC channels follow a straight line
+ * between the recorded readings on either side, so sampling faster than the
+ * recording still sees the supercaps discharge. Every other register reads
+ * as its most recent recorded value, writes land in the image until the
+ * recording next changes them, and registers that were never read back read
+ * as 0. A different sample rate, filter or threshold thereby sees the same
+ * voltages at the same points in the power fail.
+ *
+ * Once the replay clock is MICRO_REPLAY_TAIL_MS past the last transaction the
+ * process is sent SIGTERM, so a replayed run ends on its own.
+ *
+ * A recording is a micro_replay_header_t followed by records, each a
+ * micro_replay_record_t, then nmsgs micro_replay_msg_t with the len bytes of
+ * the message after each. All fields are in host byte order.
+ */
+#define MICRO_REPLAY_MAGIC 0x43524354 /* "TCRC" */
+#define MICRO_REPLAY_VERSION 1
+#define MICRO_REPLAY_TAIL_MS 1000
+#define MICRO_REPLAY_MAX_DEVS 16
+
+typedef struct micro_replay_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t realtime_ns;  /* CLOCK_REALTIME the recording started */
+	char compatible[64];   /* Board the recording was taken on */
+} micro_replay_header_t;
+
+typedef struct __attribute__((packed)) micro_replay_record {
+	uint64_t t_us;   /* Since the recording started */
+	uint8_t bus;
+	uint8_t addr;
+	uint8_t nmsgs;
+	uint8_t err;     /* errno of a failed transaction, 0 otherwise */
+} micro_replay_record_t;
+
+typedef struct __attribute__((packed)) micro_replay_msg {
+	uint8_t read;
+	uint16_t len;
+} micro_replay_msg_t;
+
+extern const micro_transport_t micro_record_transport;
+extern const micro_transport_t micro_replay_transport;
+
+int micro_record_start(const char *path, const char *compatible, const micro_transport_t *inner);
+int micro_replay_load(const char *path, int speed, micro_replay_header_t *header);
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include "micro_rt.h"
+
+typedef struct rt_log_entry {
+	int priority;
+	char msg[MICRO_RT_LOG_LEN];
+} rt_log_entry_t;
+
+/* Single producer, the daemon loop, and single consumer, the log thread.
+ * head is only written by the producer and tail only by the consumer.
+ */
+static struct {
+	int eventfd;
+	uint32_t head;
+	uint32_t tail;
+	uint64_t dropped;
+	rt_log_entry_t entries[MICRO_RT_LOG_SLOTS];
+} rt_log = { .eventfd = -1 };
+
+static void *rt_log_thread(void *arg)
+{
+	uint64_t value;
+	uint32_t tail;
+
+	while (true) {
+		if (read(rt_log.eventfd, &value, sizeof(value)) < 0 && errno != EINTR)
+			return NULL;
+
+		tail = rt_log.tail;
+		while (tail != __atomic_load_n(&rt_log.head, __ATOMIC_ACQUIRE)) {
+			rt_log_entry_t *entry = &rt_log.entries[tail % MICRO_RT_LOG_SLOTS];
+
+			syslog(entry->priority, "%s", entry->msg);
+			tail++;
+			__atomic_store_n(&rt_log.tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/* Starts the log thread. It is created with the default policy whatever the
+ * caller's, so call this before micro_rt_setup() to keep it off the
+ * real-time CPUs as well. Returns -1 with errno set on failure.
+ */
+int micro_rt_log_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	rt_log.eventfd = eventfd(0, EFD_CLOEXEC);
+	if (rt_log.eventfd < 0)
+		return -1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, rt_log_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		close(rt_log.eventfd);
+		rt_log.eventfd = -1;
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Never allocates and never blocks once the log thread is running */
+void micro_rt_log(int priority, const char *fmt, ...)
+{
+	uint64_t one = 1;
+	uint32_t head;
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (rt_log.eventfd < 0) {
+		vsyslog(priority, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	head = rt_log.head;
+	if (head - __atomic_load_n(&rt_log.tail, __ATOMIC_ACQUIRE) >= MICRO_RT_LOG_SLOTS) {
+		rt_log.dropped++;
+		va_end(ap);
+		return;
+	}
+
+	rt_log.entries[head % MICRO_RT_LOG_SLOTS].priority = priority;
+	vsnprintf(rt_log.entries[head % MICRO_RT_LOG_SLOTS].msg, MICRO_RT_LOG_LEN, fmt, ap);
+	va_end(ap);
+
+	__atomic_store_n(&rt_log.head, head + 1, __ATOMIC_RELEASE);
+	if (write(rt_log.eventfd, &one, sizeof(one)) < 0)
+		rt_log.dropped++;
+}
+
+uint64_t micro_rt_log_dropped(void)
+{
+	return rt_log.dropped;
+}
+
+/* Touches the stack the daemon may grow into, so that with the pages locked
+ * it never faults on the way down.
+ */
+static void __attribute__((noinline)) rt_prefault_stack(void)
+{
+	volatile uint8_t stack[MICRO_RT_STACK_PREFAULT];
+
+	for (size_t i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+/* Applies to the calling thread only. cpus is a mask of the CPUs to run on,
+ * 0 to leave the affinity alone. Returns -1 with errno set if any step fails.
+ */
+int micro_rt_setup(int priority, uint64_t cpus)
+{
+	struct sched_param param = { .sched_priority = priority };
+	cpu_set_t set;
+
+	if (cpus) {
+		CPU_ZERO(&set);
+		for (int cpu = 0; cpu < 64; cpu++) {
+			if (cpus & (1ULL << cpu))
+				CPU_SET(cpu, &set);
+		}
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			return -1;
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		return -1;
+	rt_prefault_stack();
+
+	if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+		return -1;
+
+	return 0;
+}
+
+void micro_latency_add(micro_latency_t *lat, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+
+	if (us) {
+		bucket = 64 - __builtin_clzll(us);
+		if (bucket >= MICRO_LATENCY_BUCKETS)
+			bucket = MICRO_LATENCY_BUCKETS - 1;
+	}
+
+	lat->count++;
+	lat->total_ns += ns;
+	if (ns > lat->max_ns)
+		lat->max_ns = ns;
+	lat->hist[bucket]++;
+}
+
+/* Accounts the wakeup for a periodic timerfd that has just been read and
+ * returned expirations. The time left until the next expiry gives away when
+ * the last one was, and every expiry missed before it is another interval
+ * late, since the wakeup was for the first.
+ */
+void micro_latency_timerfd(micro_latency_t *lat, int timerfd, uint64_t expirations)
+{
+	struct itimerspec its;
+	uint64_t interval_ns, remaining_ns;
+
+	if (timerfd_gettime(timerfd, &its) < 0)
+		return;
+
+	interval_ns = its.it_interval.tv_sec * 1000000000ULL + its.it_interval.tv_nsec;
+	remaining_ns = its.it_value.tv_sec * 1000000000ULL + its.it_value.tv_nsec;
+	if (interval_ns == 0 || remaining_ns > interval_ns || expirations == 0)
+		return;
+
+	micro_latency_add(lat, (expirations - 1) * interval_ns + interval_ns - remaining_ns);
+}
+
+void micro_latency_print(const micro_latency_t *lat, FILE *out)
+{
+	fprintf(out, "wakeups=%llu avg_us=%llu max_us=%llu log_dropped=%llu loop_max_us=%llu loop_budget_us=%u "
+		"loop_overruns=%llu hist_us=",
+		(unsigned long long)lat->count,
+		(unsigned long long)(lat->count ? lat->total_ns / lat->count / 1000 : 0),
+		(unsigned long long)(lat->max_ns / 1000), (unsigned long long)lat->log_dropped,
+		(unsigned long long)(lat->loop_max_ns / 1000), lat->loop_budget_us,
+		(unsigned long long)lat->loop_overruns);
+
+	/* Only the buckets that were hit, by their upper bound */
+	for (int b = 0, first = 1; b < MICRO_LATENCY_BUCKETS; b++) {
+		if (lat->hist[b] == 0)
+			continue;
+		if (b == MICRO_LATENCY_BUCKETS - 1)
+			fprintf(out, "%s>=%u:%u", first ? "" : ",", 1U << (b - 1), lat->hist[b]);
+		else
+			fprintf(out, "%s<%u:%u", first ? "" : ",", 1U << b, lat->hist[b]);
+		first = 0;
+	}
+	fprintf(out, "\n");
+}
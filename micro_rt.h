@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Real-time mode for the daemon
+ *
+ * micro_rt_setup() moves the calling thread to SCHED_FIFO, optionally pins
+ * it to a set of CPUs, and locks every current and future page of the
+ * process into memory with the stack prefaulted, so that nothing the daemon
+ * touches from then on can take a major page fault.
+ *
+ * syslog() can block for as long as the journal is busy, so in real-time mode
+ * micro_rt_log() only formats into a preallocated ring and a SCHED_OTHER
+ * thread started by micro_rt_log_start() hands the messages on to syslog().
+ * If the ring is full, messages are dropped and counted rather than waited
+ * for. Without micro_rt_log_start(), micro_rt_log() is plain syslog().
+ */
+#define MICRO_RT_LOG_SLOTS 64
+#define MICRO_RT_LOG_LEN 192
+#define MICRO_RT_STACK_PREFAULT (64 * 1024)
+
+/* Wakeup latency of the daemon's timers: how long after a timer expired the
+ * daemon got to run. Bucket 0 counts wakeups under 1us, bucket i those from
+ * 2^(i-1) up to 2^i us, and the last bucket everything slower.
+ */
+#define MICRO_LATENCY_BUCKETS 20
+
+typedef struct micro_latency {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t log_dropped; /* micro_rt_log() messages lost to a full ring */
+	uint32_t hist[MICRO_LATENCY_BUCKETS];
+	uint32_t loop_budget_us;  /* Per-iteration budget of the daemon loop, 0 if none */
+	uint64_t loop_max_ns;     /* Longest iteration, from poll() returning to the next poll() */
+	uint64_t loop_overruns;   /* Iterations over the budget */
+} micro_latency_t;
+
+int micro_rt_setup(int priority, uint64_t cpus);
+int micro_rt_log_start(void);
+void micro_rt_log(int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+uint64_t micro_rt_log_dropped(void);
+
+void micro_latency_add(micro_latency_t *lat, uint64_t ns);
+void micro_latency_timerfd(micro_latency_t *lat, int timerfd, uint64_t expirations);
+void micro_latency_print(const micro_latency_t *lat, FILE *out);
@@ -0,0 +1,85 @@
+#include <stdint.h>
+
+#include "micro_sched.h"
+
+void micro_sched_init(micro_sched_t *sched, int min_ms, int max_ms)
+{
+	sched->min_ms = min_ms;
+	sched->max_ms = max_ms;
+	micro_sched_reset(sched);
+}
+
+/* Forgets the slope, for when the supercaps switch between charging and
+ * discharging.
+ */
+void micro_sched_reset(micro_sched_t *sched)
+{
+	sched->count = 0;
+	sched->t_ms = 0;
+	sched->mv = 0;
+	sched->slope = 0;
+}
+
+void micro_sched_add(micro_sched_t *sched, uint64_t t_ms, uint16_t mv)
+{
+	double slope;
+
+	if (sched->count > 0) {
+		if (t_ms <= sched->t_ms)
+			return;
+
+		slope = ((double)mv - sched->mv) / (double)(t_ms - sched->t_ms);
+		if (sched->count == 1)
+			sched->slope = slope;
+		else
+			sched->slope += (slope - sched->slope) / 4;
+	}
+
+	sched->t_ms = t_ms;
+	sched->mv = mv;
+	if (sched->count < 2)
+		sched->count++;
+}
+
+/* Returns the estimated ms from the newest sample until the voltage reaches
+ * target_mv, 0 if it is already there, or -1 if the slope is not yet known or
+ * is heading away from target_mv.
+ */
+int64_t micro_sched_ms_to(const micro_sched_t *sched, uint16_t target_mv)
+{
+	double distance;
+
+	if (sched->count < 2)
+		return -1;
+	if (sched->mv == target_mv)
+		return 0;
+
+	distance = (double)target_mv - sched->mv;
+	if (sched->slope == 0 || (distance > 0) != (sched->slope > 0))
+		return -1;
+
+	return (int64_t)(distance / sched->slope);
+}
+
+/* Picks the next sample interval given the ms left until the target from
+ * micro_sched_ms_to(), or any earlier deadline the caller has. Until a slope
+ * has been measured the interval is the shortest allowed, so that it is
+ * learned quickly.
+ */
+int micro_sched_interval(const micro_sched_t *sched, int64_t eta_ms)
+{
+	int64_t interval;
+
+	if (sched->count < 2)
+		return sched->min_ms;
+	if (eta_ms < 0)
+		return sched->max_ms;
+
+	interval = eta_ms / MICRO_SCHED_STEPS;
+	if (interval < sched->min_ms)
+		return sched->min_ms;
+	if (interval > sched->max_ms)
+		return sched->max_ms;
+
+	return (int)interval;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Adaptive sample interval for the monitor daemon
+ *
+ * The slope of the supercap voltage is tracked as a moving average of the
+ * change between consecutive samples, which also smooths out the 1mV ADC
+ * steps. The next interval is picked so that about MICRO_SCHED_STEPS more
+ * samples are taken before the voltage reaches its target at that slope, so
+ * samples get denser as the supercaps approach the reboot threshold and stay
+ * sparse while they charge slowly. Intervals are clamped to [min_ms, max_ms].
+ */
+#define MICRO_SCHED_STEPS 8
+#define MICRO_SCHED_MIN_MS 20
+#define MICRO_SCHED_MAX_MS 2000
+
+typedef struct micro_sched {
+	int min_ms;
+	int max_ms;
+	int count;
+	uint64_t t_ms;
+	uint16_t mv;
+	double slope; /* mV per ms */
+} micro_sched_t;
+
+void micro_sched_init(micro_sched_t *sched, int min_ms, int max_ms);
+void micro_sched_reset(micro_sched_t *sched);
+void micro_sched_add(micro_sched_t *sched, uint64_t t_ms, uint16_t mv);
+int64_t micro_sched_ms_to(const micro_sched_t *sched, uint16_t target_mv);
+int micro_sched_interval(const micro_sched_t *sched, int64_t eta_ms);
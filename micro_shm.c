@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "micro_shm.h"
+
+#define MICRO_SHM_SIZE 4096
+
+_Static_assert(sizeof(micro_shm_page_t) <= MICRO_SHM_SIZE, "telemetry page must fit in one page");
+
+/* The daemon opens the page writable, creating and initializing it. Readers
+ * open it read-only. Returns NULL on failure with errno set.
+ */
+micro_shm_page_t *micro_shm_open(const char *path, int writable)
+{
+	micro_shm_page_t *page;
+	int fd;
+
+	fd = open(path, writable ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644);
+	if (fd == -1)
+		return NULL;
+
+	if (writable && ftruncate(fd, MICRO_SHM_SIZE) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	page = mmap(NULL, MICRO_SHM_SIZE, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED)
+		return NULL;
+
+	if (writable) {
+		/* Invalidate until the header is complete so readers back off */
+		__atomic_store_n(&page->magic, 0, __ATOMIC_RELEASE);
+		page->version = MICRO_SHM_VERSION;
+		page->seq = 0;
+		memset(&page->data, 0, sizeof(page->data));
+		__atomic_store_n(&page->magic, MICRO_SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	return page;
+}
+
+/* Only one writer, the daemon, may publish to a page */
+void micro_shm_publish(micro_shm_page_t *page, const micro_shm_data_t *data)
+{
+	uint32_t seq = page->seq;
+
+	__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&page->data, data, sizeof(*data));
+	__atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void micro_shm_close(micro_shm_page_t *page)
+{
+	munmap(page, MICRO_SHM_SIZE);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Telemetry page published by the daemon
+ *
+ * The daemon maps MICRO_SHM_PATH and rewrites the page after every sample and
+ * every power_fail# edge. Readers map the file read-only and copy it out with
+ * micro_shm_read(), which needs no syscalls and never touches the bus. The
+ * page is protected by a seqlock: seq is odd while the daemon is writing, and
+ * a reader retries until it sees the same even seq before and after its copy.
+ * A reader gives up after MICRO_SHM_READ_TRIES attempts, so a daemon killed
+ * halfway through an update cannot hang it.
+ *
+ * Readers outside of tsmicroctl need only this header and a read-only mmap()
+ * of the file, or micro_shm_open() from micro_shm.c.
+ *
+ * A daemon watching more than one supervisor publishes the first at
+ * MICRO_SHM_PATH and each further one at MICRO_SHM_SUPERVISOR_PATH, formatted
+ * with its index in the daemon's supervisor list.
+ */
+#define MICRO_SHM_PATH "/run/tsmicroctl.shm"
+#define MICRO_SHM_SUPERVISOR_PATH "/run/tsmicroctl.%d.shm"
+#define MICRO_SHM_MAGIC 0x434d5354 /* "TSMC" */
+#define MICRO_SHM_VERSION 1
+#define MICRO_SHM_READ_TRIES 100000
+
+typedef struct micro_shm_data {
+	uint64_t timestamp_ns; /* CLOCK_MONOTONIC time of the sample */
+	uint16_t scaps_mv;     /* Raw MICRO_ADC_8 reading */
+	uint8_t scaps_pct;     /* Of scaps_filtered_mv, as the daemon decides on */
+	uint8_t status_flags;  /* MICRO_STATUS_FLAGS_* */
+	uint8_t power_fail;    /* power_fail# as seen by the daemon */
+	uint8_t reserved;
+	uint16_t scaps_filtered_mv; /* Equal to scaps_mv without a filter, 0 from older daemons */
+} micro_shm_data_t;
+
+typedef struct micro_shm_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t reserved;
+	micro_shm_data_t data;
+} micro_shm_page_t;
+
+/* Returns 0 with a consistent copy of the page in data. Returns -1 with errno
+ * set to EINVAL if the page has not been initialized by a compatible daemon,
+ * or to EAGAIN if no consistent copy could be made, e.g. because the daemon
+ * died while writing the page.
+ */
+static inline int micro_shm_read(const micro_shm_page_t *page, micro_shm_data_t *data)
+{
+	uint32_t seq;
+
+	if (page->magic != MICRO_SHM_MAGIC || page->version != MICRO_SHM_VERSION) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int tries = 0; tries < MICRO_SHM_READ_TRIES; tries++) {
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(data, (const void *)&page->data, sizeof(*data));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+micro_shm_page_t *micro_shm_open(const char *path, int writable);
+void micro_shm_publish(micro_shm_page_t *page, const micro_shm_data_t *data);
+void micro_shm_close(micro_shm_page_t *page);
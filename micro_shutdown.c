@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/reboot.h>
+#ifdef HAVE_LIBSYSTEMD
+#include <systemd/sd-bus.h>
+#endif
+
+#include "micro.h"
+#include "micro_shutdown.h"
+
+#define MAX_MOUNTS 32
+
+static const char *const strategy_names[] = {
+	[MICRO_SHUTDOWN_REBOOT] = "reboot",
+	[MICRO_SHUTDOWN_POWEROFF] = "poweroff",
+	[MICRO_SHUTDOWN_EMERGENCY_REBOOT] = "emergency-reboot",
+	[MICRO_SHUTDOWN_EMERGENCY_POWEROFF] = "emergency-poweroff",
+	[MICRO_SHUTDOWN_NONE] = "none",
+};
+
+/* Filesystems that hold nothing worth syncing */
+static const char *const virtual_fs[] = {
+	"proc", "sysfs", "devtmpfs", "devpts", "tmpfs", "ramfs", "cgroup", "cgroup2", "securityfs", "debugfs",
+	"tracefs", "pstore", "bpf", "mqueue", "hugetlbfs", "configfs", "fusectl", "autofs", "efivarfs",
+	"rpc_pipefs", "binfmt_misc",
+};
+
+struct sync_job {
+	char dir[256];
+	pthread_t thread;
+	bool threaded;
+	int ret;
+};
+
+static void log_stage(const char *stage, uint64_t start_ns)
+{
+	syslog(LOG_INFO, "Shutdown: %s took %.2f ms", stage, (micro_monotonic_ns() - start_ns) / 1000000.0);
+}
+
+/* Returns the MICRO_SHUTDOWN_* value for name, or -1 if unknown */
+int micro_shutdown_parse(const char *name)
+{
+	for (int i = 0; i < sizeof(strategy_names) / sizeof(strategy_names[0]); i++) {
+		if (strcmp(name, strategy_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* Does everything that can be done before the power fails, so that firing
+ * costs as little as possible.
+ */
+void micro_shutdown_prepare(micro_shutdown_t *sd, int strategy, int sleep_seconds)
+{
+	memset(sd, 0, sizeof(*sd));
+	sd->strategy = strategy;
+	sd->sleep_seconds = sleep_seconds;
+
+#ifdef HAVE_LIBSYSTEMD
+	if (strategy == MICRO_SHUTDOWN_REBOOT || strategy == MICRO_SHUTDOWN_POWEROFF) {
+		sd_bus *bus = NULL;
+		int r = sd_bus_open_system(&bus);
+
+		if (r < 0)
+			syslog(LOG_WARNING, "Failed to connect to the system bus, will signal PID 1: %s", strerror(-r));
+		else
+			sd->bus = bus;
+	}
+#endif
+}
+
+static void systemd_shutdown(micro_shutdown_t *sd)
+{
+	bool poweroff = (sd->strategy == MICRO_SHUTDOWN_POWEROFF);
+	uint64_t start = micro_monotonic_ns();
+
+#ifdef HAVE_LIBSYSTEMD
+	if (sd->bus) {
+		sd_bus_error error = SD_BUS_ERROR_NULL;
+		int r;
+
+		r = sd_bus_call_method(sd->bus, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+				       "org.freedesktop.systemd1.Manager", "StartUnit", &error, NULL, "ss",
+				       poweroff ? "poweroff.target" : "reboot.target", "replace-irreversibly");
+		if (r >= 0) {
+			log_stage("D-Bus StartUnit", start);
+			return;
+		}
+		syslog(LOG_WARNING, "D-Bus StartUnit failed, signalling PID 1: %s",
+		       error.message ? error.message : strerror(-r));
+		sd_bus_error_free(&error);
+	}
+#endif
+
+	/* systemd starts poweroff.target on SIGRTMIN+4 and reboot.target on SIGRTMIN+5 */
+	if (kill(1, poweroff ? SIGRTMIN + 4 : SIGRTMIN + 5) < 0) {
+		syslog(LOG_ERR, "Failed to signal PID 1: %s", strerror(errno));
+		return;
+	}
+	log_stage("signal to PID 1", start);
+}
+
+static void *sync_thread(void *arg)
+{
+	struct sync_job *job = arg;
+	int fd = open(job->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd == -1) {
+		job->ret = -errno;
+		return NULL;
+	}
+	job->ret = syncfs(fd) < 0 ? -errno : 0;
+	close(fd);
+
+	return NULL;
+}
+
+static bool is_virtual_fs(const char *type)
+{
+	for (int i = 0; i < sizeof(virtual_fs) / sizeof(virtual_fs[0]); i++) {
+		if (strcmp(type, virtual_fs[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* Fills jobs with the writable, non-virtual mounts in mount order */
+static int find_writable_mounts(struct sync_job *jobs, int max)
+{
+	struct mntent *ent;
+	FILE *mounts;
+	int n = 0;
+
+	mounts = setmntent("/proc/self/mounts", "r");
+	if (mounts == NULL)
+		return 0;
+
+	while (n < max && (ent = getmntent(mounts)) != NULL) {
+		if (hasmntopt(ent, MNTOPT_RO) || is_virtual_fs(ent->mnt_type))
+			continue;
+		snprintf(jobs[n].dir, sizeof(jobs[n].dir), "%s", ent->mnt_dir);
+		n++;
+	}
+	endmntent(mounts);
+
+	return n;
+}
+
+/* Longest the emergency shutdown waits for the bus worker to arm the sleep.
+ * A worker stuck for longer than that is on a hung bus, and reboot(2) is
+ * not held up for it.
+ */
+#define SLEEP_ARM_TIMEOUT_MS 250
+
+static void emergency_shutdown(micro_shutdown_t *sd, micro_worker_t *worker, micro_req_t *sleep_req)
+{
+	static struct sync_job jobs[MAX_MOUNTS];
+	bool poweroff = (sd->strategy == MICRO_SHUTDOWN_EMERGENCY_POWEROFF);
+	uint64_t start;
+	int n;
+
+	start = micro_monotonic_ns();
+	n = find_writable_mounts(jobs, MAX_MOUNTS);
+	for (int i = 0; i < n; i++) {
+		jobs[i].threaded = (pthread_create(&jobs[i].thread, NULL, sync_thread, &jobs[i]) == 0);
+		if (!jobs[i].threaded)
+			sync_thread(&jobs[i]);
+	}
+	for (int i = 0; i < n; i++) {
+		if (jobs[i].threaded)
+			pthread_join(jobs[i].thread, NULL);
+		if (jobs[i].ret < 0)
+			syslog(LOG_WARNING, "Failed to sync %s: %s", jobs[i].dir, strerror(-jobs[i].ret));
+	}
+	log_stage("parallel syncfs", start);
+
+	/* Children before their parents, so in reverse mount order */
+	start = micro_monotonic_ns();
+	for (int i = n - 1; i >= 0; i--) {
+		if (mount(NULL, jobs[i].dir, NULL, MS_REMOUNT | MS_RDONLY, NULL) < 0)
+			syslog(LOG_WARNING, "Failed to remount %s read-only: %s", jobs[i].dir, strerror(errno));
+	}
+	log_stage("read-only remount", start);
+
+	/* Armed only now that the filesystems are safe, since the micro cuts
+	 * power as soon as it takes the command. It must not exit on failure
+	 * either: the mounts are read-only by now and reboot(2) still has to run.
+	 */
+	if (sd->sleep_seconds) {
+		start = micro_monotonic_ns();
+		sleep_req->reg = MICRO_CMD;
+		sleep_req->wlen = 5;
+		micro_sleep_cmd(sleep_req->wbuf, sd->sleep_seconds);
+		if (micro_worker_call(worker, sleep_req, SLEEP_ARM_TIMEOUT_MS) < 0)
+			syslog(LOG_ERR, "Failed to arm micro sleep: %s", strerror(errno));
+		log_stage("arming micro sleep", start);
+	}
+
+	syslog(LOG_INFO, "Shutdown: calling reboot(2)");
+	reboot(poweroff ? RB_POWER_OFF : RB_AUTOBOOT);
+	syslog(LOG_ERR, "reboot(2) failed: %s", strerror(errno));
+}
+
+/* Runs the prepared strategy. Only the first call does anything, so the
+ * daemon can keep calling this for as long as the threshold stays crossed.
+ */
+void micro_shutdown_fire(micro_shutdown_t *sd, micro_worker_t *worker, micro_req_t *sleep_req)
+{
+	if (sd->fired)
+		return;
+	sd->fired = true;
+
+	syslog(LOG_INFO, "Shutdown: starting %s", strategy_names[sd->strategy]);
+
+	switch (sd->strategy) {
+	case MICRO_SHUTDOWN_REBOOT:
+	case MICRO_SHUTDOWN_POWEROFF:
+		systemd_shutdown(sd);
+		break;
+	case MICRO_SHUTDOWN_EMERGENCY_REBOOT:
+	case MICRO_SHUTDOWN_EMERGENCY_POWEROFF:
+		emergency_shutdown(sd, worker, sleep_req);
+		break;
+	case MICRO_SHUTDOWN_NONE:
+		break;
+	}
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "micro_worker.h"
+
+/* Shutdown strategies for the daemon
+ *
+ * MICRO_SHUTDOWN_REBOOT and MICRO_SHUTDOWN_POWEROFF ask systemd to start
+ * reboot.target or poweroff.target, over D-Bus when built with libsystemd and
+ * otherwise with the equivalent signal to PID 1. The emergency strategies skip
+ * the service stop sequence entirely: every writable filesystem is synced in
+ * parallel and remounted read-only before reboot(2) is called directly. The
+ * micro sleep they may arm is written by the daemon's bus worker, through
+ * sleep_req, which must be a MICRO_REQ_WRITE to the board's own supervisor.
+ * MICRO_SHUTDOWN_NONE only logs that the shutdown would have started, for
+ * replays and bench runs.
+ */
+#define MICRO_SHUTDOWN_REBOOT 0
+#define MICRO_SHUTDOWN_POWEROFF 1
+#define MICRO_SHUTDOWN_EMERGENCY_REBOOT 2
+#define MICRO_SHUTDOWN_EMERGENCY_POWEROFF 3
+#define MICRO_SHUTDOWN_NONE 4
+
+typedef struct micro_shutdown {
+	int strategy;
+	int sleep_seconds; /* Emergency only: arm micro_sleep() before reboot(2), 0 to skip */
+	void *bus;         /* D-Bus connection opened ahead of time */
+	bool fired;
+} micro_shutdown_t;
+
+int micro_shutdown_parse(const char *name);
+void micro_shutdown_prepare(micro_shutdown_t *sd, int strategy, int sleep_seconds);
+void micro_shutdown_fire(micro_shutdown_t *sd, micro_worker_t *worker, micro_req_t *sleep_req);
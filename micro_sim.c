@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <linux/i2c.h>
+
+#include "micro.h"
+#include "micro_sim.h"
+
+/* Defaults approximate a TS-7180 on a 100kHz bus: 9 bit times per byte */
+micro_sim_config_t micro_sim_config = {
+	.initial_mv = 4800,
+	.full_mv = 4800,
+	.capacitance_mf = 6000,
+	.load_mw = 3000,
+	.power_fail_ms = -1,
+	.power_restore_ms = -1,
+	.time_scale = 1,
+	.xfer_latency_us = 50,
+	.byte_latency_us = 90,
+	.revision = 1,
+	.build = "simulated",
+};
+
+static struct {
+	struct timespec start;
+	uint32_t now_ms;
+	double scaps_mv;
+	uint8_t status_flags;
+	uint8_t charge_current_default[2];
+	uint8_t charge_current[2];
+	uint8_t cmd[5];
+	unsigned long xfers; /* Attempted, for fail_every */
+	micro_sim_stats_t stats;
+} sim;
+
+static uint32_t elapsed_ms(void)
+{
+	struct timespec now;
+	uint64_t ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - sim.start.tv_sec) * 1000ULL;
+	ms += (now.tv_nsec - sim.start.tv_nsec) / 1000000L;
+
+	return (uint32_t)(ms * micro_sim_config.time_scale);
+}
+
+static bool power_failed_at(uint32_t ms)
+{
+	if (micro_sim_config.power_fail_ms < 0 || ms < micro_sim_config.power_fail_ms)
+		return false;
+	if (micro_sim_config.power_restore_ms < 0 || ms < micro_sim_config.power_restore_ms)
+		return true;
+	return false;
+}
+
+/* Integrates the supercap voltage over [from, to) where the power state does
+ * not change. Charging is constant current, dV = I * dt / C, and discharging
+ * is constant power, d(V^2) = -2 * P * dt / C.
+ */
+static void advance_segment(uint32_t from, uint32_t to)
+{
+	double dt = to - from;
+	double c = micro_sim_config.capacitance_mf;
+
+	if (power_failed_at(from)) {
+		double v2 = sim.scaps_mv * sim.scaps_mv;
+
+		v2 -= 2.0 * micro_sim_config.load_mw * dt * 1000.0 / c;
+		sim.scaps_mv = (v2 > 0) ? sqrt(v2) : 0;
+	} else if (sim.status_flags & MICRO_STATUS_FLAGS_SCAPS_EN) {
+		uint16_t ma = (sim.charge_current[0] << 8) | sim.charge_current[1];
+
+		sim.scaps_mv += ma * dt / c;
+		if (sim.scaps_mv > micro_sim_config.full_mv)
+			sim.scaps_mv = micro_sim_config.full_mv;
+	}
+}
+
+static void advance(void)
+{
+	uint32_t now = elapsed_ms();
+	uint32_t edges[2] = { micro_sim_config.power_fail_ms, micro_sim_config.power_restore_ms };
+	uint32_t from = sim.now_ms;
+
+	for (int i = 0; i < 2; i++) {
+		if ((int32_t)edges[i] >= 0 && edges[i] > from && edges[i] < now) {
+			advance_segment(from, edges[i]);
+			from = edges[i];
+		}
+	}
+	advance_segment(from, now);
+	sim.now_ms = now;
+
+	sim.status_flags &= ~(MICRO_STATUS_FLAGS_POWER_FAIL | MICRO_STATUS_FLAGS_SCAPS_MET_MIN |
+			      MICRO_STATUS_FLAGS_SCAPS_CHARGING);
+	if (power_failed_at(now))
+		sim.status_flags |= MICRO_STATUS_FLAGS_POWER_FAIL;
+	else if ((sim.status_flags & MICRO_STATUS_FLAGS_SCAPS_EN) && sim.scaps_mv < micro_sim_config.full_mv)
+		sim.status_flags |= MICRO_STATUS_FLAGS_SCAPS_CHARGING;
+	if (sim.scaps_mv >= 3680)
+		sim.status_flags |= MICRO_STATUS_FLAGS_SCAPS_MET_MIN;
+}
+
+static uint8_t read_reg(uint16_t reg)
+{
+	uint16_t adc[11] = { 5000, 450, 3300, 12000, 35, 0, 0, 0, 0, 0, 38 };
+
+	adc[MICRO_ADC_CHANNEL(MICRO_ADC_7)] = sim.scaps_mv / 2;
+	adc[MICRO_ADC_CHANNEL(MICRO_ADC_8)] = sim.scaps_mv;
+
+	if (reg < MICRO_STATUS_FLAGS)
+		return (reg & 1) ? adc[reg / 2] & 0xff : adc[reg / 2] >> 8;
+	if (reg == MICRO_STATUS_FLAGS)
+		return sim.status_flags;
+	if (reg >= MICRO_CHARGE_CURRENT_DEFAULT && reg < MICRO_CHARGE_CURRENT)
+		return sim.charge_current_default[reg - MICRO_CHARGE_CURRENT_DEFAULT];
+	if (reg >= MICRO_CHARGE_CURRENT && reg < MICRO_CHARGE_CURRENT + 2)
+		return sim.charge_current[reg - MICRO_CHARGE_CURRENT];
+	if (reg >= MICRO_CMD && reg < MICRO_CMD + sizeof(sim.cmd))
+		return sim.cmd[reg - MICRO_CMD];
+	if (reg == MICRO_REVISION)
+		return micro_sim_config.revision;
+	if (reg >= MICRO_BUILD_STRING && reg - MICRO_BUILD_STRING < strlen(micro_sim_config.build))
+		return micro_sim_config.build[reg - MICRO_BUILD_STRING];
+
+	return 0;
+}
+
+static void write_reg(uint16_t reg, uint8_t value)
+{
+	if (reg == MICRO_STATUS_FLAGS) {
+		sim.status_flags &= ~MICRO_STATUS_FLAGS_SCAPS_EN;
+		sim.status_flags |= value & MICRO_STATUS_FLAGS_SCAPS_EN;
+	} else if (reg >= MICRO_CHARGE_CURRENT_DEFAULT && reg < MICRO_CHARGE_CURRENT) {
+		sim.charge_current_default[reg - MICRO_CHARGE_CURRENT_DEFAULT] = value;
+	} else if (reg >= MICRO_CHARGE_CURRENT && reg < MICRO_CHARGE_CURRENT + 2) {
+		sim.charge_current[reg - MICRO_CHARGE_CURRENT] = value;
+	} else if (reg >= MICRO_CMD && reg < MICRO_CMD + sizeof(sim.cmd)) {
+		sim.cmd[reg - MICRO_CMD] = value;
+	}
+}
+
+static int micro_sim_open(int i2cbus, int i2caddr)
+{
+	int fd;
+
+	/* Nothing is ever done with the fd, it only has to be valid */
+	fd = open("/dev/null", O_RDWR);
+	if (fd == -1) {
+		perror("Couldn't open simulated micro");
+		exit(1);
+	}
+
+	memset(&sim, 0, sizeof(sim));
+	clock_gettime(CLOCK_MONOTONIC, &sim.start);
+	sim.scaps_mv = micro_sim_config.initial_mv;
+	sim.status_flags = MICRO_STATUS_FLAGS_SCAPS_EN;
+	sim.charge_current_default[1] = 100;
+	sim.charge_current[1] = 100;
+	advance();
+
+	return fd;
+}
+
+static int micro_sim_transfer(int fd, struct i2c_msg *msgs, int nmsgs)
+{
+	struct timespec delay;
+	uint16_t reg = 0;
+	uint32_t us;
+	int bytes = 0;
+
+	advance();
+
+	/* Not retried by micro_transfer(), so every injected failure is seen */
+	if (micro_sim_config.fail_every && ++sim.xfers % micro_sim_config.fail_every == 0) {
+		errno = EIO;
+		return -1;
+	}
+
+	for (int i = 0; i < nmsgs; i++) {
+		struct i2c_msg *msg = &msgs[i];
+
+		if (msg->flags & I2C_M_RD) {
+			for (int j = 0; j < msg->len; j++)
+				msg->buf[j] = read_reg(reg++);
+		} else {
+			if (msg->len < 2) {
+				errno = EINVAL;
+				return -1;
+			}
+			reg = (msg->buf[0] << 8) | msg->buf[1];
+			for (int j = 2; j < msg->len; j++)
+				write_reg(reg++, msg->buf[j]);
+		}
+		/* Each message is preceded by the chip address byte */
+		bytes += msg->len + 1;
+	}
+
+	us = micro_sim_config.xfer_latency_us + bytes * micro_sim_config.byte_latency_us;
+	sim.stats.transactions++;
+	sim.stats.bytes += bytes;
+	sim.stats.bus_us += us;
+
+	if (us) {
+		delay.tv_sec = us / 1000000;
+		delay.tv_nsec = (us % 1000000) * 1000L;
+		nanosleep(&delay, NULL);
+	}
+
+	return nmsgs;
+}
+
+const micro_transport_t micro_sim_transport = {
+	.name = "sim",
+	.open = micro_sim_open,
+	.transfer = micro_sim_transfer,
+};
+
+/* Current simulated time, for driving scenarios from outside the library */
+uint32_t micro_sim_now_ms(void)
+{
+	advance();
+	return sim.now_ms;
+}
+
+void micro_sim_get_stats(micro_sim_stats_t *stats)
+{
+	*stats = sim.stats;
+}
+
+void micro_sim_reset_stats(void)
+{
+	memset(&sim.stats, 0, sizeof(sim.stats));
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+/* Simulated supervisory microcontroller
+ *
+ * Implements the register map in micro.h behind micro_sim_transport so the
+ * library can be exercised and benchmarked without hardware. The supercaps
+ * charge at the programmed MICRO_CHARGE_CURRENT and discharge into a constant
+ * power load while power fails. Every transaction is delayed by the time it
+ * would occupy the real bus. Failed transfers can be injected to exercise the
+ * error paths.
+ */
+typedef struct micro_sim_config {
+	int initial_mv;       /* Supercap voltage when the transport is opened */
+	int full_mv;          /* Voltage at which charging stops */
+	int capacitance_mf;   /* Supercap bank capacitance */
+	int load_mw;          /* Load drawn from the supercaps during power fail */
+	int power_fail_ms;    /* Simulated time power fails, -1 for never */
+	int power_restore_ms; /* Simulated time power returns, -1 for never */
+	int time_scale;       /* Simulated ms that pass per real ms */
+	int xfer_latency_us;  /* Fixed cost of each transaction */
+	int byte_latency_us;  /* Bus time per byte, including the ACK bit */
+	int fail_every;       /* Every nth transaction fails with EIO, 0 for none */
+	uint8_t revision;
+	const char *build;
+} micro_sim_config_t;
+
+typedef struct micro_sim_stats {
+	unsigned long transactions;
+	unsigned long bytes;
+	unsigned long bus_us;
+} micro_sim_stats_t;
+
+extern micro_sim_config_t micro_sim_config;
+extern const micro_transport_t micro_sim_transport;
+
+uint32_t micro_sim_now_ms(void);
+void micro_sim_get_stats(micro_sim_stats_t *stats);
+void micro_sim_reset_stats(void);
@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "micro_sock.h"
+
+static int fill_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+/* Without a path the server is left closed, polling and serving nothing */
+int micro_sock_server_open(micro_sock_server_t *server, const char *path)
+{
+	struct sockaddr_un addr;
+
+	server->listen_fd = -1;
+	for (int i = 0; i < MICRO_SOCK_MAX_CLIENTS; i++)
+		server->clients[i] = -1;
+
+	if (path == NULL)
+		return 0;
+	if (fill_addr(&addr, path) < 0)
+		return -1;
+
+	server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server->listen_fd < 0)
+		return -1;
+
+	/* A socket left behind by a previous instance would fail bind() */
+	unlink(path);
+
+	if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    chmod(path, 0666) < 0 || listen(server->listen_fd, MICRO_SOCK_MAX_CLIENTS) < 0) {
+		close(server->listen_fd);
+		server->listen_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Unused slots are set to -1 so that poll() skips them */
+void micro_sock_server_pollfds(micro_sock_server_t *server, struct pollfd *pfds)
+{
+	pfds[0].fd = server->listen_fd;
+	pfds[0].events = POLLIN;
+	for (int i = 0; i < MICRO_SOCK_MAX_CLIENTS; i++) {
+		pfds[1 + i].fd = server->clients[i];
+		pfds[1 + i].events = POLLIN;
+		pfds[1 + i].revents = 0;
+	}
+}
+
+static void serve_client(int fd, micro_sock_handler_t handler, void *ctx)
+{
+	static uint8_t reply[MICRO_SOCK_MAX_REPLY];
+	struct iovec iov[2];
+	struct msghdr msg = { 0 };
+	uint32_t cmd, len;
+
+	if (recv(fd, &cmd, sizeof(cmd), MSG_DONTWAIT) != sizeof(cmd))
+		return;
+
+	len = handler(cmd, reply, sizeof(reply), ctx);
+
+	iov[0].iov_base = &len;
+	iov[0].iov_len = sizeof(len);
+	iov[1].iov_base = reply;
+	iov[1].iov_len = len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	/* Replies fit in the socket buffer, a client that is gone is ignored */
+	sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* Accepts new clients and answers any pending requests without blocking */
+void micro_sock_server_process(micro_sock_server_t *server, struct pollfd *pfds, micro_sock_handler_t handler,
+			       void *ctx)
+{
+	int fd;
+
+	for (int i = 0; i < MICRO_SOCK_MAX_CLIENTS; i++) {
+		if (server->clients[i] == -1 || pfds[1 + i].revents == 0)
+			continue;
+		if (pfds[1 + i].revents & POLLIN)
+			serve_client(server->clients[i], handler, ctx);
+		close(server->clients[i]);
+		server->clients[i] = -1;
+	}
+
+	if (server->listen_fd == -1 || !(pfds[0].revents & POLLIN))
+		return;
+
+	while ((fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		int slot = 0;
+
+		/* A free slot, or else the oldest client's */
+		for (int i = 0; i < MICRO_SOCK_MAX_CLIENTS; i++) {
+			if (server->clients[i] == -1) {
+				slot = i;
+				break;
+			}
+			if ((int32_t)(server->client_seq[i] - server->client_seq[slot]) < 0)
+				slot = i;
+		}
+		if (server->clients[slot] != -1)
+			close(server->clients[slot]);
+		server->clients[slot] = fd;
+		server->client_seq[slot] = server->accepted++;
+	}
+}
+
+void micro_sock_server_close(micro_sock_server_t *server, const char *path)
+{
+	for (int i = 0; i < MICRO_SOCK_MAX_CLIENTS; i++) {
+		if (server->clients[i] != -1)
+			close(server->clients[i]);
+	}
+	if (server->listen_fd != -1) {
+		close(server->listen_fd);
+		unlink(path);
+	}
+}
+
+/* Returns 0 if a daemon answered with exactly size bytes, -1 otherwise,
+ * including when no daemon is running.
+ */
+int micro_sock_query(const char *path, uint32_t cmd, void *reply, size_t size)
+{
+	struct sockaddr_un addr;
+	struct timeval timeout = { .tv_sec = 1 };
+	uint32_t len;
+	int fd, ret = -1;
+
+	if (fill_addr(&addr, path) < 0)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	/* A wedged daemon must not hang the caller */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto out;
+	if (send(fd, &cmd, sizeof(cmd), MSG_NOSIGNAL) != sizeof(cmd))
+		goto out;
+	if (recv(fd, &len, sizeof(len), MSG_WAITALL) != sizeof(len) || len != size)
+		goto out;
+	if (recv(fd, reply, size, MSG_WAITALL) != size)
+		goto out;
+	ret = 0;
+
+out:
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <poll.h>
+#include <stdint.h>
+
+/* Local telemetry socket served by the daemon
+ *
+ * A client connects, sends one uint32_t request and gets back a uint32_t
+ * payload length followed by the payload. A length of 0 means the request
+ * is not supported. Each connection carries a single request. The socket is
+ * open to every local user, so when all client slots are taken, a new client
+ * evicts the one that has been connected longest rather than being turned
+ * away. Holding connections open cannot lock out --info.
+ */
+#define MICRO_SOCK_PATH "/run/tsmicroctl.sock"
+#define MICRO_SOCK_MAX_CLIENTS 4
+#define MICRO_SOCK_NFDS (1 + MICRO_SOCK_MAX_CLIENTS)
+#define MICRO_SOCK_MAX_REPLY 4096
+
+#define MICRO_SOCK_CMD_INFO 1 /* Reply is a micro_info_t */
+#define MICRO_SOCK_CMD_STATS 2 /* Reply is a micro_stats_t, if the daemon runs with --stats */
+#define MICRO_SOCK_CMD_LATENCY 3 /* Reply is a micro_latency_t */
+
+/* The upper 16 bits of a request select the supervisor it is about, by index
+ * in the daemon's supervisor list. Requests without them go to the first.
+ */
+#define MICRO_SOCK_CMD_MASK 0xffff
+#define MICRO_SOCK_CMD_SUPERVISOR_SHIFT 16
+#define MICRO_SOCK_CMD_SUPERVISOR(cmd, index) ((uint32_t)(cmd) | ((uint32_t)(index) << MICRO_SOCK_CMD_SUPERVISOR_SHIFT))
+
+/* Fills reply with up to size bytes and returns the length, or 0 if cmd is unknown */
+typedef size_t (*micro_sock_handler_t)(uint32_t cmd, void *reply, size_t size, void *ctx);
+
+typedef struct micro_sock_server {
+	int listen_fd;
+	int clients[MICRO_SOCK_MAX_CLIENTS];
+	uint32_t client_seq[MICRO_SOCK_MAX_CLIENTS]; /* Order accepted in, to find the oldest */
+	uint32_t accepted;
+} micro_sock_server_t;
+
+int micro_sock_server_open(micro_sock_server_t *server, const char *path);
+void micro_sock_server_pollfds(micro_sock_server_t *server, struct pollfd *pfds);
+void micro_sock_server_process(micro_sock_server_t *server, struct pollfd *pfds, micro_sock_handler_t handler,
+			       void *ctx);
+void micro_sock_server_close(micro_sock_server_t *server, const char *path);
+
+int micro_sock_query(const char *path, uint32_t cmd, void *reply, size_t size);
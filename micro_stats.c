@@ -0,0 +1,126 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <linux/i2c.h>
+
+#include "micro.h"
+#include "micro_stats.h"
+
+bool micro_stats_enabled;
+micro_stats_t micro_stats;
+
+/* Held for every update of micro_stats and every snapshot of it */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Finds or claims the slot for reg and dir, the last slot takes whatever
+ * does not fit.
+ */
+static micro_stats_entry_t *stats_entry(uint16_t reg, uint8_t dir)
+{
+	micro_stats_entry_t *entry;
+
+	for (int i = 0; i < MICRO_STATS_SLOTS - 1; i++) {
+		entry = &micro_stats.entries[i];
+		if (!entry->used) {
+			entry->used = 1;
+			entry->reg = reg;
+			entry->dir = dir;
+			return entry;
+		}
+		if (entry->reg == reg && entry->dir == dir)
+			return entry;
+	}
+
+	entry = &micro_stats.entries[MICRO_STATS_SLOTS - 1];
+	entry->used = 1;
+	entry->reg = MICRO_STATS_OTHER;
+	entry->dir = dir;
+	return entry;
+}
+
+static int stats_bucket(uint64_t us)
+{
+	int bucket;
+
+	if (us == 0)
+		return 0;
+
+	bucket = 64 - __builtin_clzll(us);
+	return (bucket < MICRO_STATS_BUCKETS) ? bucket : MICRO_STATS_BUCKETS - 1;
+}
+
+/* Every transaction starts with a write of the big endian register address,
+ * and reads if any of its messages do.
+ */
+void micro_stats_record(const struct i2c_msg *msgs, int nmsgs, uint64_t start_ns, int retries, bool failed)
+{
+	micro_stats_entry_t *entry;
+	uint8_t dir = MICRO_STATS_WRITE;
+	uint16_t reg = 0;
+	uint64_t us;
+	uint32_t bytes = 0;
+
+	us = (micro_monotonic_ns() - start_ns) / 1000;
+
+	if (nmsgs > 0 && msgs[0].len >= 2)
+		reg = (msgs[0].buf[0] << 8) | msgs[0].buf[1];
+	for (int i = 0; i < nmsgs; i++) {
+		if (msgs[i].flags & I2C_M_RD)
+			dir = MICRO_STATS_READ;
+		bytes += msgs[i].len;
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	entry = stats_entry(reg, dir);
+	entry->count++;
+	entry->retries += retries;
+	if (failed)
+		entry->errors++;
+	else
+		entry->bytes += bytes;
+	entry->total_us += us;
+	entry->hist[stats_bucket(us)]++;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* Copies micro_stats out consistently, while other threads may be recording */
+void micro_stats_snapshot(micro_stats_t *stats)
+{
+	pthread_mutex_lock(&stats_lock);
+	memcpy(stats, &micro_stats, sizeof(*stats));
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void micro_stats_print(const micro_stats_t *stats, FILE *out)
+{
+	for (int i = 0; i < MICRO_STATS_SLOTS; i++) {
+		const micro_stats_entry_t *entry = &stats->entries[i];
+
+		if (!entry->used)
+			continue;
+
+		if (entry->reg == MICRO_STATS_OTHER)
+			fprintf(out, "reg=other");
+		else
+			fprintf(out, "reg=%d", entry->reg);
+		fprintf(out, " dir=%s count=%u bytes=%llu errors=%u retries=%u avg_us=%llu hist_us=",
+			entry->dir == MICRO_STATS_READ ? "read" : "write", entry->count,
+			(unsigned long long)entry->bytes, entry->errors, entry->retries,
+			(unsigned long long)(entry->count ? entry->total_us / entry->count : 0));
+
+		/* Only the buckets that were hit, by their upper bound */
+		for (int b = 0, first = 1; b < MICRO_STATS_BUCKETS; b++) {
+			if (entry->hist[b] == 0)
+				continue;
+			if (b == MICRO_STATS_BUCKETS - 1)
+				fprintf(out, "%s>=%u:%u", first ? "" : ",", 1U << (b - 1), entry->hist[b]);
+			else
+				fprintf(out, "%s<%u:%u", first ? "" : ",", 1U << b, entry->hist[b]);
+			first = 0;
+		}
+		fprintf(out, "\n");
+	}
+}
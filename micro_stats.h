@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* I2C transaction instrumentation
+ *
+ * When micro_stats_enabled is set, every transaction through micro_read() and
+ * micro_write() is accounted to the register it starts at and its direction:
+ * count, bytes on the bus, retries, failures and a latency histogram with
+ * power of two buckets. Bucket 0 counts transactions under 1us, bucket i
+ * those from 2^(i-1) up to 2^i us, and the last bucket everything slower.
+ * When disabled, the cost is a single branch per transaction.
+ *
+ * The layout is fixed so the daemon can hand the whole table to clients.
+ * Both the daemon's loop and its bus worker record transactions, so updates
+ * are made under a lock, and a running daemon's table has to be copied out
+ * with micro_stats_snapshot() rather than read directly.
+ */
+#define MICRO_STATS_BUCKETS 16
+#define MICRO_STATS_SLOTS 32
+#define MICRO_STATS_OTHER 0xffff /* Register of the slot that collects overflow */
+
+#define MICRO_STATS_READ 0
+#define MICRO_STATS_WRITE 1
+
+typedef struct micro_stats_entry {
+	uint16_t reg;
+	uint8_t dir;
+	uint8_t used;
+	uint32_t count;
+	uint32_t errors;  /* Transactions that still failed after retrying */
+	uint32_t retries; /* Extra attempts after transient failures */
+	uint64_t bytes;
+	uint64_t total_us;
+	uint32_t hist[MICRO_STATS_BUCKETS];
+} micro_stats_entry_t;
+
+typedef struct micro_stats {
+	micro_stats_entry_t entries[MICRO_STATS_SLOTS];
+} micro_stats_t;
+
+struct i2c_msg;
+
+extern bool micro_stats_enabled;
+extern micro_stats_t micro_stats;
+
+void micro_stats_record(const struct i2c_msg *msgs, int nmsgs, uint64_t start_ns, int retries, bool failed);
+void micro_stats_snapshot(micro_stats_t *stats);
+void micro_stats_print(const micro_stats_t *stats, FILE *out);
@@ -0,0 +1,211 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "micro_trace.h"
+
+/* Maps the trace file at path, creating it and its directory if needed.
+ * Returns NULL with errno set on failure.
+ */
+micro_trace_t *micro_trace_open(const char *path)
+{
+	micro_trace_t *trace;
+	char dir[4096];
+	int fd;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	if (mkdir(dirname(dir), 0755) < 0 && errno != EEXIST)
+		return NULL;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, sizeof(*trace)) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	trace = mmap(NULL, sizeof(*trace), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (trace == MAP_FAILED)
+		return NULL;
+
+	if (trace->magic != MICRO_TRACE_MAGIC || trace->version != MICRO_TRACE_VERSION) {
+		memset(trace, 0, sizeof(*trace));
+		trace->magic = MICRO_TRACE_MAGIC;
+		trace->version = MICRO_TRACE_VERSION;
+	}
+
+	return trace;
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Claims the next record, overwriting the oldest once the file is full. The
+ * count goes up first, so an event cut short by the power going out is still
+ * found by the report.
+ */
+micro_trace_event_t *micro_trace_begin(micro_trace_t *trace, int supervisor, uint16_t flags, uint64_t edge_ns,
+				       uint64_t seen_ns)
+{
+	micro_trace_event_t *event;
+
+	if (trace == NULL)
+		return NULL;
+
+	event = &trace->events[trace->count % MICRO_TRACE_EVENTS];
+	memset(event, 0, sizeof(*event));
+	trace->count++;
+
+	event->realtime_ns = clock_ns(CLOCK_REALTIME) - (clock_ns(CLOCK_MONOTONIC) - edge_ns);
+	event->edge_ns = edge_ns;
+	event->seen_ns = seen_ns;
+	event->supervisor = supervisor;
+	event->flags = flags;
+
+	return event;
+}
+
+void micro_trace_close(micro_trace_t *trace)
+{
+	if (trace)
+		munmap(trace, sizeof(*trace));
+}
+
+/* Stages of the response, each from one recorded time to a later one */
+static const struct {
+	const char *name;
+	size_t from;
+	size_t to;
+} stages[] = {
+	{ "wakeup", offsetof(micro_trace_event_t, edge_ns), offsetof(micro_trace_event_t, seen_ns) },
+	{ "first_sample", offsetof(micro_trace_event_t, edge_ns), offsetof(micro_trace_event_t, sample_ns) },
+	{ "decision", offsetof(micro_trace_event_t, crossing_ns), offsetof(micro_trace_event_t, decision_ns) },
+	{ "shutdown", offsetof(micro_trace_event_t, decision_ns), offsetof(micro_trace_event_t, shutdown_ns) },
+	{ "holdup", offsetof(micro_trace_event_t, edge_ns), offsetof(micro_trace_event_t, crossing_ns) },
+	{ "total", offsetof(micro_trace_event_t, edge_ns), offsetof(micro_trace_event_t, shutdown_ns) },
+};
+
+#define TRACE_NSTAGES (sizeof(stages) / sizeof(stages[0]))
+
+static uint64_t event_time(const micro_trace_event_t *event, size_t offset)
+{
+	uint64_t ns;
+
+	memcpy(&ns, (const uint8_t *)event + offset, sizeof(ns));
+	return ns;
+}
+
+/* Returns the duration of stage in ns, or -1 if the event never got there */
+static int64_t stage_ns(const micro_trace_event_t *event, int stage)
+{
+	uint64_t from = event_time(event, stages[stage].from);
+	uint64_t to = event_time(event, stages[stage].to);
+
+	if (from == 0 || to == 0 || to < from)
+		return -1;
+	return to - from;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of sorted */
+static int64_t percentile(const int64_t *sorted, int n, int pct)
+{
+	int rank = (pct * n + 99) / 100;
+
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/* Prints every recorded event, oldest first, followed by the min, max and
+ * percentiles of each stage across them. Returns -1 with errno set if the
+ * trace cannot be read.
+ */
+int micro_trace_report(const char *path, FILE *out)
+{
+	static int64_t values[TRACE_NSTAGES][MICRO_TRACE_EVENTS];
+	int nvalues[TRACE_NSTAGES] = { 0 };
+	micro_trace_t *trace;
+	uint64_t first;
+	char stamp[32];
+	struct tm tm;
+	time_t when;
+	FILE *file;
+	size_t len;
+
+	trace = malloc(sizeof(*trace));
+	if (trace == NULL)
+		return -1;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		free(trace);
+		return -1;
+	}
+	len = fread(trace, 1, sizeof(*trace), file);
+	fclose(file);
+	if (len != sizeof(*trace) || trace->magic != MICRO_TRACE_MAGIC || trace->version != MICRO_TRACE_VERSION) {
+		free(trace);
+		errno = EINVAL;
+		return -1;
+	}
+
+	first = trace->count > MICRO_TRACE_EVENTS ? trace->count - MICRO_TRACE_EVENTS : 0;
+	for (uint64_t i = first; i < trace->count; i++) {
+		const micro_trace_event_t *event = &trace->events[i % MICRO_TRACE_EVENTS];
+
+		when = event->realtime_ns / 1000000000ULL;
+		gmtime_r(&when, &tm);
+		strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+		fprintf(out, "event=%llu time=%s supervisor=%u edge=%s outcome=%s", (unsigned long long)i, stamp,
+			event->supervisor, (event->flags & MICRO_TRACE_POLLED) ? "polled" : "gpio",
+			event->shutdown_ns ? "shutdown" : event->restored_ns ? "restored" : "incomplete");
+
+		for (int s = 0; s < TRACE_NSTAGES; s++) {
+			int64_t ns = stage_ns(event, s);
+
+			if (ns < 0)
+				continue;
+			fprintf(out, " %s_us=%lld", stages[s].name, (long long)(ns / 1000));
+			values[s][nvalues[s]++] = ns;
+		}
+		fprintf(out, "\n");
+	}
+
+	for (int s = 0; s < TRACE_NSTAGES; s++) {
+		int n = nvalues[s];
+
+		if (n == 0)
+			continue;
+		qsort(values[s], n, sizeof(values[s][0]), compare_ns);
+		fprintf(out, "stage=%s events=%d min_us=%lld p50_us=%lld p90_us=%lld p99_us=%lld max_us=%lld\n",
+			stages[s].name, n, (long long)(values[s][0] / 1000),
+			(long long)(percentile(values[s], n, 50) / 1000),
+			(long long)(percentile(values[s], n, 90) / 1000),
+			(long long)(percentile(values[s], n, 99) / 1000), (long long)(values[s][n - 1] / 1000));
+	}
+
+	free(trace);
+	return 0;
+}
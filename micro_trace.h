@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Power fail response tracing
+ *
+ * For every power fail event the daemon records when each stage of its
+ * response happened, from the kernel's timestamp of the power_fail# edge to
+ * the shutdown strategy being invoked. The records live in a file mapped
+ * MAP_SHARED, so recording a stage is a plain store into memory with no
+ * syscall, and the sync done on the way down writes it out. Records from
+ * earlier boots survive for micro_trace_report() to summarize.
+ *
+ * All stage times are CLOCK_MONOTONIC nanoseconds of the boot the event
+ * happened in, 0 for stages that were never reached.
+ */
+#define MICRO_TRACE_MAGIC 0x52544354 /* "TCTR" */
+#define MICRO_TRACE_VERSION 1
+#define MICRO_TRACE_EVENTS 256
+
+/* power_fail# was noticed in the status flags, there is no edge timestamp */
+#define MICRO_TRACE_POLLED (1 << 0)
+
+typedef struct micro_trace_event {
+	uint64_t realtime_ns; /* CLOCK_REALTIME of the edge, to tell events apart */
+	uint64_t edge_ns;     /* power_fail# asserted */
+	uint64_t seen_ns;     /* Daemon read the edge */
+	uint64_t sample_ns;   /* First ADC sample of the event completed */
+	uint64_t crossing_ns; /* Sample that crossed the threshold or shutdown budget completed */
+	uint64_t decision_ns; /* Reboot decided */
+	uint64_t shutdown_ns; /* Shutdown strategy invoked */
+	uint64_t restored_ns; /* Power returned instead */
+	uint16_t supervisor;  /* Index in the daemon's supervisor list */
+	uint16_t flags;       /* MICRO_TRACE_* */
+	uint32_t reserved;
+} micro_trace_event_t;
+
+typedef struct micro_trace {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t count; /* Events ever recorded, the latest is at (count - 1) % MICRO_TRACE_EVENTS */
+	micro_trace_event_t events[MICRO_TRACE_EVENTS];
+} micro_trace_t;
+
+micro_trace_t *micro_trace_open(const char *path);
+micro_trace_event_t *micro_trace_begin(micro_trace_t *trace, int supervisor, uint16_t flags, uint64_t edge_ns,
+				       uint64_t seen_ns);
+void micro_trace_close(micro_trace_t *trace);
+int micro_trace_report(const char *path, FILE *out);
@@ -0,0 +1,211 @@
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "micro.h"
+#include "micro_watch.h"
+
+/* Registers reported besides the board's ADC channels, named as in --info */
+#define WATCH_MAX_FIELDS (6 + MICRO_ADC_MAX_CHANNELS)
+
+static volatile sig_atomic_t watch_stop;
+
+static void watch_signal(int sig)
+{
+	watch_stop = 1;
+}
+
+/* Whole seconds and the remainder are scaled separately so that neither
+ * product can overflow, however long the watch runs.
+ */
+static uint64_t deadline_ns(uint64_t start_ns, uint64_t seq, int hz)
+{
+	return start_ns + seq / hz * 1000000000ULL + seq % hz * 1000000000ULL / hz;
+}
+
+/* Latest deadline at or before now_ns */
+static uint64_t deadline_seq(uint64_t start_ns, uint64_t now_ns, int hz)
+{
+	uint64_t elapsed = now_ns - start_ns;
+
+	return elapsed / 1000000000ULL * hz + elapsed % 1000000000ULL * hz / 1000000000ULL;
+}
+
+/* Column names for CSV and keys for JSON Lines, in output order */
+static int watch_names(const board_t *board, const char **names)
+{
+	int n = 0;
+
+	names[n++] = "micro_startup_celcius";
+	names[n++] = "micro_celcius";
+	names[n++] = "status_flags";
+	if (board->has_silo) {
+		names[n++] = "supercaps_remaining_pct";
+		names[n++] = "supercaps_charge_current_ma";
+		names[n++] = "supercaps_charge_current_default_ma";
+	}
+	for (int i = 0; i < board->adc_nchannels; i++)
+		names[n++] = board->adc_channels[i].name;
+
+	return n;
+}
+
+static void watch_values(const board_t *board, const micro_snapshot_t *snap, uint32_t *values)
+{
+	int n = 0;
+
+	values[n++] = snap->adc[MICRO_ADC_CHANNEL(MICRO_ADC_4)];
+	values[n++] = snap->adc[MICRO_ADC_CHANNEL(MICRO_ADC_10)];
+	values[n++] = snap->status_flags;
+	if (board->has_silo) {
+		values[n++] = micro_scaps_remaining_pct(snap);
+		values[n++] = snap->charge_current;
+		values[n++] = snap->charge_current_default;
+	}
+	micro_adc_convert(board, snap, &values[n]);
+}
+
+static void watch_header(FILE *out, int format, int hz, uint64_t start_ns, const char **names, int nfields)
+{
+	micro_watch_bin_header_t header;
+	struct timespec ts;
+
+	if (format == MICRO_WATCH_BIN) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		header.magic = MICRO_WATCH_BIN_MAGIC;
+		header.version = 1;
+		header.hz = hz;
+		header.start_ns = start_ns;
+		header.start_realtime_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		fwrite(&header, sizeof(header), 1, out);
+	} else if (format == MICRO_WATCH_CSV) {
+		fprintf(out, "t_ns,seq");
+		for (int i = 0; i < nfields; i++)
+			fprintf(out, ",%s", names[i]);
+		fputc('\n', out);
+	}
+}
+
+static void watch_record(FILE *out, int format, const board_t *board, uint64_t t_ns, uint32_t seq,
+			 const micro_snapshot_t *snap, const char **names, int nfields)
+{
+	micro_watch_bin_record_t record;
+	uint32_t values[WATCH_MAX_FIELDS];
+
+	if (format == MICRO_WATCH_BIN) {
+		record.t_ns = t_ns;
+		record.seq = seq;
+		record.snap = *snap;
+		fwrite(&record, sizeof(record), 1, out);
+		return;
+	}
+
+	watch_values(board, snap, values);
+	if (format == MICRO_WATCH_CSV) {
+		fprintf(out, "%llu,%u", (unsigned long long)t_ns, seq);
+		for (int i = 0; i < nfields; i++)
+			fprintf(out, ",%u", values[i]);
+		fputc('\n', out);
+	} else {
+		fprintf(out, "{\"t_ns\":%llu,\"seq\":%u", (unsigned long long)t_ns, seq);
+		for (int i = 0; i < nfields; i++)
+			fprintf(out, ",\"%s\":%u", names[i], values[i]);
+		fputs("}\n", out);
+	}
+}
+
+/* Samples at hz until count samples are written, or until SIGINT or SIGTERM
+ * if count is 0. Returns 0 once stopped and flushed, or -1 with errno set if
+ * the bus or the output fails.
+ */
+int micro_watch(micro_dev_t *dev, board_t *board, int hz, int format, uint64_t count, FILE *out,
+		micro_watch_stats_t *stats)
+{
+	static char buf[MICRO_WATCH_BUF_SIZE];
+	struct sigaction sa = { .sa_handler = watch_signal };
+	struct itimerspec its = { 0 };
+	const char *names[WATCH_MAX_FIELDS];
+	micro_snapshot_t snap;
+	uint64_t start_ns, deadline, now_ns, late_ns, expirations;
+	uint64_t seq = 0, next;
+	int nfields, timerfd;
+	int ret = 0;
+
+	assert(hz > 0 && hz <= MICRO_WATCH_MAX_HZ);
+	assert(board->adc_nchannels <= MICRO_ADC_MAX_CHANNELS);
+	memset(stats, 0, sizeof(*stats));
+
+	/* Only the handler is ours, without SA_RESTART the timerfd read is interrupted */
+	watch_stop = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	setvbuf(out, buf, _IOFBF, sizeof(buf));
+
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timerfd < 0) {
+		perror("Failed to create timer");
+		return -1;
+	}
+
+	nfields = watch_names(board, names);
+	start_ns = micro_monotonic_ns();
+	watch_header(out, format, hz, start_ns, names, nfields);
+
+	while (!watch_stop && (count == 0 || stats->samples < count)) {
+		deadline = deadline_ns(start_ns, seq, hz);
+		its.it_value.tv_sec = deadline / 1000000000ULL;
+		its.it_value.tv_nsec = deadline % 1000000000ULL;
+		if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+			perror("Failed to arm timer");
+			ret = -1;
+			break;
+		}
+		if (read(timerfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+			if (errno == EINTR)
+				continue;
+			perror("Failed to wait for timer");
+			ret = -1;
+			break;
+		}
+
+		now_ns = micro_monotonic_ns();
+		if (micro_read_snapshot(dev, &snap) < 0) {
+			perror("Failed to read supervisor registers");
+			ret = -1;
+			break;
+		}
+		watch_record(out, format, board, now_ns, seq, &snap, names, nfields);
+
+		late_ns = now_ns - deadline;
+		stats->samples++;
+		stats->late_total_ns += late_ns;
+		if (late_ns > stats->late_max_ns)
+			stats->late_max_ns = late_ns;
+
+		/* Catch up with the most recent deadline that has passed, if any
+		 * beyond the next one have, rather than sampling back to back.
+		 */
+		next = deadline_seq(start_ns, micro_monotonic_ns(), hz);
+		if (next > seq + 1) {
+			stats->missed += next - seq - 1;
+			seq = next;
+		} else {
+			seq++;
+		}
+	}
+
+	close(timerfd);
+
+	if (fflush(out) != 0 || ferror(out))
+		ret = -1;
+
+	return ret;
+}
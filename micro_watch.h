@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Streaming register capture for bench characterization
+ *
+ * Keeps the supervisor open and reads the full register snapshot once per
+ * deadline. Deadlines are absolute, start + n / hz on CLOCK_MONOTONIC, so a
+ * late wakeup never pushes the later samples back. A deadline that has
+ * already passed by the time the previous sample is written out is skipped
+ * and counted as missed; seq in the output has a gap where that happened.
+ *
+ * Samples are streamed to a fully buffered FILE as CSV, JSON Lines or packed
+ * binary records, and flushed when the watch stops.
+ */
+#define MICRO_WATCH_MAX_HZ 1000
+#define MICRO_WATCH_BUF_SIZE 65536
+
+#define MICRO_WATCH_CSV 0
+#define MICRO_WATCH_JSON 1
+#define MICRO_WATCH_BIN 2
+
+#define MICRO_WATCH_BIN_MAGIC 0x57435354 /* "TSCW" */
+
+/* Binary streams are this header followed by micro_watch_bin_record_t
+ * records, all in host byte order.
+ */
+typedef struct __attribute__((packed)) micro_watch_bin_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t hz;
+	uint64_t start_ns;          /* CLOCK_MONOTONIC of seq 0 */
+	uint64_t start_realtime_ns; /* CLOCK_REALTIME at about the same time */
+} micro_watch_bin_header_t;
+
+typedef struct __attribute__((packed, aligned(2))) micro_watch_bin_record {
+	uint64_t t_ns; /* CLOCK_MONOTONIC just before the read */
+	uint32_t seq;  /* Deadline the sample was taken for */
+	micro_snapshot_t snap;
+} micro_watch_bin_record_t;
+
+typedef struct micro_watch_stats {
+	uint64_t samples;
+	uint64_t missed;        /* Deadlines skipped */
+	uint64_t late_total_ns; /* Time from deadline to read, over all samples */
+	uint64_t late_max_ns;
+} micro_watch_stats_t;
+
+int micro_watch(micro_dev_t *dev, board_t *board, int hz, int format, uint64_t count, FILE *out,
+		micro_watch_stats_t *stats);
@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "micro.h"
+#include "micro_worker.h"
+
+static bool queue_push(micro_queue_t *queue, micro_req_t *req)
+{
+	uint32_t head = queue->head;
+
+	if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) >= MICRO_WORKER_QUEUE)
+		return false;
+	queue->slots[head % MICRO_WORKER_QUEUE] = req;
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static micro_req_t *queue_pop(micro_queue_t *queue)
+{
+	uint32_t tail = queue->tail;
+	micro_req_t *req;
+
+	if (tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	req = queue->slots[tail % MICRO_WORKER_QUEUE];
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	return req;
+}
+
+static void worker_run(micro_req_t *req)
+{
+	switch (req->op) {
+	case MICRO_REQ_SNAPSHOT:
+		req->ret = micro_read_snapshot(req->dev, &req->snap);
+		if (req->ret < 0)
+			break;
+		req->mv = req->snap.adc[MICRO_ADC_CHANNEL(MICRO_ADC_8)];
+		if (req->filter == NULL)
+			break;
+		if (req->filter_reset) {
+			micro_filter_reset(req->filter);
+			req->filter_reset = false;
+		}
+		req->mv = micro_filter_sample(req->filter, req->dev, req->mv);
+		req->filter_reads = req->filter->reads;
+		req->filter_bus_ns = req->filter->bus_ns;
+		break;
+	case MICRO_REQ_ADC_8:
+		req->ret = micro_try_read16_swap(req->dev, MICRO_ADC_8, &req->mv);
+		break;
+	case MICRO_REQ_WRITE:
+		req->ret = micro_try_write(req->dev, req->reg, req->wbuf, req->wlen);
+		break;
+	default:
+		req->ret = -1;
+		errno = EINVAL;
+		break;
+	}
+	req->ret = (req->ret < 0) ? -1 : 0;
+	req->err = (req->ret < 0) ? errno : 0;
+	req->done_ns = micro_monotonic_ns();
+}
+
+static void *worker_thread(void *arg)
+{
+	micro_worker_t *worker = arg;
+	uint64_t value, one = 1;
+	micro_req_t *req;
+
+	while (!__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)) {
+		if (read(worker->submit_fd, &value, sizeof(value)) < 0 && errno != EINTR)
+			break;
+
+		while ((req = queue_pop(&worker->submit)) != NULL) {
+			worker_run(req);
+			/* Every request in flight has a slot, so this cannot fail */
+			queue_push(&worker->complete, req);
+			if (write(worker->complete_fd, &one, sizeof(one)) < 0)
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+/* The worker inherits the caller's scheduling policy and affinity, so in
+ * real-time mode start it after micro_rt_setup(). Returns -1 with errno set
+ * on failure.
+ */
+int micro_worker_start(micro_worker_t *worker)
+{
+	int ret;
+
+	memset(worker, 0, sizeof(*worker));
+
+	worker->submit_fd = eventfd(0, EFD_CLOEXEC);
+	if (worker->submit_fd < 0)
+		return -1;
+	worker->complete_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (worker->complete_fd < 0) {
+		close(worker->submit_fd);
+		return -1;
+	}
+
+	ret = pthread_create(&worker->thread, NULL, worker_thread, worker);
+	if (ret != 0) {
+		close(worker->complete_fd);
+		close(worker->submit_fd);
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns -1 without submitting if req is still in flight or the ring is full */
+int micro_worker_submit(micro_worker_t *worker, micro_req_t *req)
+{
+	uint64_t one = 1;
+
+	if (req->busy)
+		return -1;
+
+	req->busy = true;
+	req->submit_ns = micro_monotonic_ns();
+	if (!queue_push(&worker->submit, req)) {
+		req->busy = false;
+		return -1;
+	}
+
+	if (write(worker->submit_fd, &one, sizeof(one)) < 0)
+		return -1;
+	return 0;
+}
+
+/* Returns the next finished request, or NULL once there are none left. Call
+ * it until NULL whenever complete_fd polls readable.
+ */
+micro_req_t *micro_worker_complete(micro_worker_t *worker)
+{
+	micro_req_t *req;
+	uint64_t value;
+
+	req = queue_pop(&worker->complete);
+	if (req == NULL) {
+		/* Reset the count, then look again for anything that raced in */
+		if (read(worker->complete_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+			return NULL;
+		req = queue_pop(&worker->complete);
+		if (req == NULL)
+			return NULL;
+	}
+
+	req->busy = false;
+	return req;
+}
+
+/* Submits req and waits up to timeout_ms for it to come back, for callers
+ * that have nothing else to do meanwhile, like a shutdown. Other requests
+ * that finish while waiting are taken off the ring and dropped, their owners
+ * see them idle again and resubmit. Returns req's result, or -1 with
+ * ETIMEDOUT if the worker did not get to it in time, in which case req is
+ * still in flight.
+ */
+int micro_worker_call(micro_worker_t *worker, micro_req_t *req, int timeout_ms)
+{
+	uint64_t deadline = micro_monotonic_ns() + timeout_ms * 1000000ULL;
+	struct pollfd pfd = { .fd = worker->complete_fd, .events = POLLIN };
+	micro_req_t *done;
+	uint64_t now;
+
+	if (micro_worker_submit(worker, req) < 0) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	while ((now = micro_monotonic_ns()) < deadline) {
+		while ((done = micro_worker_complete(worker)) != NULL) {
+			if (done == req) {
+				errno = req->err;
+				return req->ret;
+			}
+		}
+		poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+	}
+
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+/* Waits for the request in progress, if any, to finish */
+void micro_worker_stop(micro_worker_t *worker)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&worker->stop, true, __ATOMIC_RELEASE);
+	if (write(worker->submit_fd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(worker->thread, NULL);
+	close(worker->complete_fd);
+	close(worker->submit_fd);
+}
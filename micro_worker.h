@@ -0,0 +1,73 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "micro.h"
+#include "micro_filter.h"
+
+/* Bus worker for the daemon
+ *
+ * The worker thread owns all of the daemon's bus I/O once its loop is
+ * running. The loop hands it preallocated requests through a lock-free
+ * single-producer single-consumer ring and goes back to poll(). The worker
+ * hands each finished request back through a second ring and signals
+ * complete_fd, which the loop polls next to its GPIO and timer fds. A slow or
+ * NAKed transaction therefore delays only its own result, and never the
+ * handling of power_fail# edges or the reboot decision.
+ *
+ * A request belongs to the worker from micro_worker_submit() until it comes
+ * back from micro_worker_complete(), and must not be touched in between.
+ * The filter of a sample request is the worker's too, so the loop resets it
+ * through filter_reset rather than itself. Even the emergency shutdown's
+ * write goes through the worker, with micro_worker_call().
+ */
+#define MICRO_WORKER_QUEUE 32 /* Power of two, at least the requests that can be in flight */
+
+#define MICRO_REQ_SNAPSHOT 0 /* Reads the register snapshot into snap, and MICRO_ADC_8 through filter into mv */
+#define MICRO_REQ_ADC_8 1    /* Reads MICRO_ADC_8 into mv */
+#define MICRO_REQ_WRITE 2    /* Writes wlen bytes of wbuf to reg */
+
+#define MICRO_REQ_WRITE_MAX 8
+
+typedef struct micro_req {
+	micro_dev_t *dev;
+	int op;          /* MICRO_REQ_* */
+	void *owner;     /* For the submitter to find its way back */
+	micro_filter_t *filter; /* MICRO_REQ_SNAPSHOT only, used by the worker alone */
+	bool filter_reset; /* Restart the filter before this sample, cleared once done */
+	bool busy;       /* Owned by the worker */
+	uint64_t submit_ns;
+	uint64_t done_ns;
+	int ret;         /* 0, or -1 with err set */
+	int err;
+	micro_snapshot_t snap;
+	uint16_t mv;
+	uint64_t filter_reads;  /* The filter's counters as of this sample */
+	uint64_t filter_bus_ns;
+	uint16_t reg;    /* MICRO_REQ_WRITE only */
+	uint8_t wlen;
+	uint8_t wbuf[MICRO_REQ_WRITE_MAX];
+} micro_req_t;
+
+typedef struct micro_queue {
+	uint32_t head; /* Written by the producer only */
+	uint32_t tail; /* Written by the consumer only */
+	micro_req_t *slots[MICRO_WORKER_QUEUE];
+} micro_queue_t;
+
+typedef struct micro_worker {
+	pthread_t thread;
+	int submit_fd;   /* eventfd the worker sleeps on */
+	int complete_fd; /* eventfd for the submitter to poll */
+	bool stop;
+	micro_queue_t submit;
+	micro_queue_t complete;
+} micro_worker_t;
+
+int micro_worker_start(micro_worker_t *worker);
+int micro_worker_submit(micro_worker_t *worker, micro_req_t *req);
+micro_req_t *micro_worker_complete(micro_worker_t *worker);
+int micro_worker_call(micro_worker_t *worker, micro_req_t *req, int timeout_ms);
+void micro_worker_stop(micro_worker_t *worker);
@@ -1,16 +1,25 @@
 #pragma once
 
-void ts7100_info(int i2cfd, board_t *board);
+static const micro_adc_channel_t ts7100_adc_channels[] = {
+	{ MICRO_ADC_0, "adc_5v_a_mv", MICRO_ADC_RAW },
+	{ MICRO_ADC_1, "an_sup_chrg", MICRO_ADC_RAW },
+	{ MICRO_ADC_2, "adc_3p3v_mv", MICRO_ADC_RAW },
+	{ MICRO_ADC_3, "adc_8v_48v_mv", MICRO_ADC_RAW },
+	{ MICRO_ADC_7, "adc_an_sup_cap_1_mv", MICRO_ADC_RAW },
+	{ MICRO_ADC_8, "adc_an_sup_cap_2_mv", MICRO_ADC_RAW },
+};
 
 const board_t ts7100_board = {
 	.compatible = "technologic,ts7100",
 	.i2c_bus = 0,
 	.i2c_chip = 0x54,
-	.info_function = ts7100_info,
+	.info_function = micro_generic_info,
 	.has_silo = 1,
 	.power_fail_active = 1,
 	.power_fail_bank = "20ac000.gpio",
 	.power_fail_io = 0,
 	.max_current = 900,
 	.min_current = 50,
+	.adc_channels = ts7100_adc_channels,
+	.adc_nchannels = sizeof(ts7100_adc_channels) / sizeof(ts7100_adc_channels[0]),
 };
@@ -1,16 +1,30 @@
 #pragma once
 
-void ts7180_info(int i2cfd, board_t *board);
+static const micro_adc_channel_t ts7180_adc_channels[] = {
+	{ MICRO_ADC_0, "adc_5v_a_mv", MICRO_ADC_DIVIDER(53600, 42200) },
+	{ MICRO_ADC_1, "adc_an_chrg_mv", MICRO_ADC_DIVIDER(20000, 14700) },
+	{ MICRO_ADC_2, "adc_3p3v_mv", MICRO_ADC_DIVIDER(42200, 42200) },
+	{ MICRO_ADC_3, "adc_vin_mv", MICRO_ADC_DIVIDER(191000, 10700) },
+	{ MICRO_ADC_7, "adc_an_sup_cap_1_mv", MICRO_ADC_RAW },
+	{ MICRO_ADC_8, "adc_an_sup_cap_2_mv", MICRO_ADC_RAW },
+};
 
 const board_t ts7180_board = {
 	.compatible = "technologic,ts7180",
 	.i2c_bus = 0,
 	.i2c_chip = 0x54,
-	.info_function = ts7180_info,
+	.info_function = micro_generic_info,
 	.has_silo = 1,
 	.power_fail_active = 1,
 	.power_fail_bank = "20ac000.gpio",
 	.power_fail_io = 0,
 	.max_current = 900,
 	.min_current = 50,
+	.adc_channels = ts7180_adc_channels,
+	.adc_nchannels = sizeof(ts7180_adc_channels) / sizeof(ts7180_adc_channels[0]),
+	/* Not characterized yet. The energy model stays off until the bank's
+	 * capacitance, floor and converter efficiency are taken from the
+	 * datasheet or measured on a unit, with the source cited here.
+	 */
+	.scaps_capacitance_mf = 0,
 };
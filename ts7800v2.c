@@ -1,12 +0,0 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <fcntl.h>
-#include <unistd.h>
-
-#include "micro.h"
-
-void ts7800v2_info(int i2cfd, board_t *board)
-{
-	micro_generic_info(i2cfd, board);
-}
@@ -13,6 +13,17 @@
 #include <getopt.h>
 
 #include "micro.h"
+#include "micro_sock.h"
+#include "micro_capture.h"
+#include "micro_shutdown.h"
+#include "micro_sched.h"
+#include "micro_stats.h"
+#include "micro_cache.h"
+#include "micro_watch.h"
+#include "micro_rt.h"
+#include "micro_trace.h"
+#include "micro_filter.h"
+#include "micro_replay.h"
 #include "ts7100.h"
 #include "ts7180.h"
 #include "ts7800v2.h"
@@ -49,24 +60,192 @@ void usage(char **argv, board_t *board)
 		"  -i, --info               Print current information about supercaps\n"
 		"  -c, --current <mA>       Permanently set max charging mA (default: 100, min: %d, max: %d)\n"
 		"  -s, --sleep <seconds>    Turns off power to everything for a specified number of seconds\n"
+		"      --capture <hz>       With --daemon, record the supercap voltage at hz during power fails (max: %d)\n"
+		"      --capture-dir <dir>  Where discharge captures are written (default: /var/log/tsmicroctl)\n"
+		"      --capture-format <f> Discharge capture format, csv or bin (default: csv)\n"
+		"      --shutdown-budget <ms>\n"
+		"                           With --daemon, also reboot once the supercaps are predicted empty within ms\n"
+		"      --shutdown <how>     How --daemon shuts down: reboot, poweroff, emergency-reboot,\n"
+		"                           emergency-poweroff or none to only log it (default: reboot)\n"
+		"      --shutdown-sleep <seconds>\n"
+		"                           With an emergency shutdown, turn off power for seconds before rebooting\n"
+		"      --sample-min-ms <ms> Shortest --daemon sample interval, used near the threshold (default: %d)\n"
+		"      --sample-max-ms <ms> Longest --daemon sample interval, used while charging slowly (default: %d)\n"
+		"      --metrics <file>     With --daemon, keep a node_exporter textfile of the readings up to date\n"
+		"      --filter <f>         Filter the supercap voltage --daemon and --wait-pct decide on, none,\n"
+		"                           median or ema (default: none). ema lags a falling voltage by about %d\n"
+		"                           samples; median adds no lag\n"
+		"      --filter-samples <n> Voltage readings per filtered sample (2-%d, default: %d)\n"
+		"      --supervisor <bus>:<addr>[:<percent>[:<gpiochip>:<line>]]\n"
+		"                           With --daemon, also watch the supervisor at addr on bus, rebooting at\n"
+		"                           percent (default: as --daemon) and watching power_fail# on line of the\n"
+		"                           GPIO chip labelled gpiochip (default: its status flags). Repeatable\n"
+		"      --watch <hz>         Stream every register to stdout at hz until interrupted (max: %d)\n"
+		"      --watch-format <f>   --watch output format, csv, jsonl or bin (default: csv)\n"
+		"      --watch-count <n>    Stop --watch after n samples\n"
+		"      --rt-priority <prio> Run the --daemon loop SCHED_FIFO at prio (1-99) with memory locked\n"
+		"      --rt-cpus <list>     With --rt-priority, pin the --daemon loop to CPUs, e.g. 0,2-3\n"
+		"      --loop-budget <us>   With --daemon, log and count loop iterations that take longer than us\n"
+		"      --latency            Print the running daemon's timer wakeup latency and loop overruns\n"
+		"      --trace <file>       With --daemon, record how long each stage of every power fail response takes\n"
+		"      --trace-report <file>\n"
+		"                           Print the recorded power fail responses and their latency percentiles\n"
+		"      --record <file>      Record every I2C transaction to file for --replay\n"
+		"      --replay <file>      Serve the supervisors and board from a --record recording instead of the\n"
+		"                           bus, never shutting down for real\n"
+		"      --replay-speed <x>   Replay x times faster than recorded (default: 1)\n"
+		"      --stats              Count I2C transactions. With --daemon, serve the counts to --stats;\n"
+		"                           alone, print the running daemon's counts; otherwise print our own\n"
 		"  -h, --help               This message\n"
 		"\n",
 		argv[0],
 		board->min_current,
-		board->max_current);
+		board->max_current,
+		MICRO_CAPTURE_MAX_HZ,
+		MICRO_SCHED_MIN_MS,
+		MICRO_SCHED_MAX_MS,
+		1 << MICRO_FILTER_EMA_SHIFT,
+		MICRO_FILTER_MAX_SAMPLES,
+		MICRO_FILTER_DEFAULT_SAMPLES,
+		MICRO_WATCH_MAX_HZ);
 }
 
+/* Options that have no short form */
+enum {
+	OPT_CAPTURE = 256,
+	OPT_CAPTURE_DIR,
+	OPT_CAPTURE_FORMAT,
+	OPT_SHUTDOWN_BUDGET,
+	OPT_SHUTDOWN,
+	OPT_SHUTDOWN_SLEEP,
+	OPT_SAMPLE_MIN_MS,
+	OPT_SAMPLE_MAX_MS,
+	OPT_METRICS,
+	OPT_FILTER,
+	OPT_FILTER_SAMPLES,
+	OPT_SUPERVISOR,
+	OPT_WATCH,
+	OPT_WATCH_FORMAT,
+	OPT_WATCH_COUNT,
+	OPT_RT_PRIORITY,
+	OPT_RT_CPUS,
+	OPT_LOOP_BUDGET,
+	OPT_LATENCY,
+	OPT_TRACE,
+	OPT_TRACE_REPORT,
+	OPT_RECORD,
+	OPT_REPLAY,
+	OPT_REPLAY_SPEED,
+	OPT_STATS,
+};
+
 board_t boards[] = {
 	ts7100_board,
 	ts7180_board,
 	ts7800v2_board,
 };
 
-board_t *get_board()
+/* Parses a --supervisor argument into a copy of the detected board with the
+ * supervisor's bus, address and power_fail# line. Returns -1 if it is malformed.
+ */
+static int parse_supervisor(char *arg, const board_t *board, board_t *sup_board, int *reboot_pct)
+{
+	char *fields[5] = { NULL };
+	char *end, *save;
+	int nfields = 0;
+	long value;
+
+	for (char *field = strtok_r(arg, ":", &save); field; field = strtok_r(NULL, ":", &save)) {
+		if (nfields == 5)
+			return -1;
+		fields[nfields++] = field;
+	}
+	if (nfields < 2 || nfields == 4)
+		return -1;
+
+	*sup_board = *board;
+	sup_board->power_fail_bank = NULL;
+	*reboot_pct = -1;
+
+	value = strtol(fields[0], &end, 0);
+	if (*end != '\0' || value < 0)
+		return -1;
+	sup_board->i2c_bus = value;
+
+	value = strtol(fields[1], &end, 0);
+	if (*end != '\0' || value < 0x03 || value > 0x77)
+		return -1;
+	sup_board->i2c_chip = value;
+
+	if (nfields > 2) {
+		value = strtol(fields[2], &end, 10);
+		if (*end != '\0' || value < 0 || value > 100)
+			return -1;
+		*reboot_pct = value;
+	}
+
+	if (nfields > 3) {
+		value = strtol(fields[4], &end, 10);
+		if (*end != '\0' || value < 0)
+			return -1;
+		sup_board->power_fail_bank = fields[3];
+		sup_board->power_fail_io = value;
+	}
+
+	return 0;
+}
+
+/* Parses a CPU list such as 0,2-3 into a mask. Returns -1 if it is malformed. */
+static int parse_cpus(const char *arg, uint64_t *mask)
+{
+	const char *p = arg;
+	long first, last;
+	char *end;
+
+	*mask = 0;
+	do {
+		first = strtol(p, &end, 10);
+		if (end == p)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				return -1;
+		}
+		if (first < 0 || last < first || last > 63)
+			return -1;
+		for (long cpu = first; cpu <= last; cpu++)
+			*mask |= 1ULL << cpu;
+		p = end + 1;
+	} while (*end == ',');
+
+	return (*end == '\0') ? 0 : -1;
+}
+
+/* Returns the board a devicetree compatible string names, or NULL */
+board_t *find_board(micro_cache_t *cache, const char *comp)
+{
+	for (int i = 0; i < sizeof(boards) / sizeof(boards[0]); i++) {
+		if (strstr(comp, boards[i].compatible) != NULL) {
+			cache->board_index = i;
+			cache->dirty = 1;
+			return &boards[i];
+		}
+	}
+	return NULL;
+}
+
+board_t *get_board(micro_cache_t *cache)
 {
 	FILE *file;
 	char comp[256];
 
+	/* Detected earlier in this boot */
+	if (cache->board_index >= 0 && cache->board_index < sizeof(boards) / sizeof(boards[0]))
+		return &boards[cache->board_index];
+
 	file = fopen("/sys/firmware/devicetree/base/compatible", "r");
 	if (!file) {
 		perror("Unable to open /sys/firmware/devicetree/base/compatible");
@@ -96,20 +275,19 @@ board_t *get_board()
 	}
 	fclose(file);
 
-	for (int i = 0; i < sizeof(boards) / sizeof(boards[0]); i++) {
-		if (strstr(comp, boards[i].compatible) != NULL) {
-			return &boards[i];
-		}
-	}
-	return NULL;
+	return find_board(cache, comp);
 }
 
 int main(int argc, char *argv[])
 {
 	board_t *board;
+	micro_info_t info;
+	micro_cache_t cache;
 	int option_index = 0;
 	int c;
-	int i2cfd;
+	micro_dev_t *dev = NULL;
+	int lockfd;
+	int ret;
 
 	int opt_enable = 0;
 	int opt_disable = 0;
@@ -119,17 +297,36 @@ int main(int argc, char *argv[])
 	int opt_current = -1;
 	int opt_sleep = -1;
 	int opt_nonsleep_opt = 0;
-
-	board = get_board();
-	if (board == NULL) {
-		printf("Unsupported platform\n");
-		return 1;
-	}
-
-	if (argc < 2) {
-		usage(argv, board);
-		return 1;
-	}
+	int opt_stats = 0;
+	int opt_watch_hz = 0;
+	int opt_watch_format = MICRO_WATCH_CSV;
+	long long opt_watch_count = 0;
+	micro_watch_stats_t watch_stats;
+	micro_latency_t latency;
+	int opt_latency = 0;
+	const char *opt_trace_report = NULL;
+	const char *opt_record = NULL;
+	const char *opt_replay = NULL;
+	int opt_replay_speed = 1;
+	micro_replay_header_t replay_header;
+	micro_filter_t wait_filter;
+	board_t sup_boards[MICRO_DAEMON_MAX_SUPERVISORS];
+	int sup_pcts[MICRO_DAEMON_MAX_SUPERVISORS];
+	micro_supervisor_t sups[MICRO_DAEMON_MAX_SUPERVISORS];
+	int nsups = 1; /* The board's own supervisor comes first */
+	micro_daemon_opts_t daemon_opts = {
+		.capture_hz = 0,
+		.capture_dir = "/var/log/tsmicroctl",
+		.capture_format = MICRO_CAPTURE_CSV,
+		.shutdown_budget_ms = 0,
+		.shutdown_strategy = MICRO_SHUTDOWN_REBOOT,
+		.shutdown_sleep_s = 0,
+		.sample_min_ms = MICRO_SCHED_MIN_MS,
+		.sample_max_ms = MICRO_SCHED_MAX_MS,
+		.metrics_path = NULL,
+		.filter = MICRO_FILTER_NONE,
+		.filter_samples = MICRO_FILTER_DEFAULT_SAMPLES,
+	};
 
 	static struct option long_options[] = { { "enable", no_argument, NULL, 'e' },
 						{ "disable", no_argument, NULL, 'd' },
@@ -139,8 +336,80 @@ int main(int argc, char *argv[])
 						{ "current", required_argument, NULL, 'c' },
 						{ "sleep", required_argument, NULL, 's' },
 						{ "help", no_argument, NULL, 'h' },
+						{ "capture", required_argument, NULL, OPT_CAPTURE },
+						{ "capture-dir", required_argument, NULL, OPT_CAPTURE_DIR },
+						{ "capture-format", required_argument, NULL, OPT_CAPTURE_FORMAT },
+						{ "shutdown-budget", required_argument, NULL, OPT_SHUTDOWN_BUDGET },
+						{ "shutdown", required_argument, NULL, OPT_SHUTDOWN },
+						{ "shutdown-sleep", required_argument, NULL, OPT_SHUTDOWN_SLEEP },
+						{ "sample-min-ms", required_argument, NULL, OPT_SAMPLE_MIN_MS },
+						{ "sample-max-ms", required_argument, NULL, OPT_SAMPLE_MAX_MS },
+						{ "metrics", required_argument, NULL, OPT_METRICS },
+						{ "filter", required_argument, NULL, OPT_FILTER },
+						{ "filter-samples", required_argument, NULL, OPT_FILTER_SAMPLES },
+						{ "supervisor", required_argument, NULL, OPT_SUPERVISOR },
+						{ "watch", required_argument, NULL, OPT_WATCH },
+						{ "watch-format", required_argument, NULL, OPT_WATCH_FORMAT },
+						{ "watch-count", required_argument, NULL, OPT_WATCH_COUNT },
+						{ "rt-priority", required_argument, NULL, OPT_RT_PRIORITY },
+						{ "rt-cpus", required_argument, NULL, OPT_RT_CPUS },
+						{ "loop-budget", required_argument, NULL, OPT_LOOP_BUDGET },
+						{ "latency", no_argument, NULL, OPT_LATENCY },
+						{ "trace", required_argument, NULL, OPT_TRACE },
+						{ "trace-report", required_argument, NULL, OPT_TRACE_REPORT },
+						{ "record", required_argument, NULL, OPT_RECORD },
+						{ "replay", required_argument, NULL, OPT_REPLAY },
+						{ "replay-speed", required_argument, NULL, OPT_REPLAY_SPEED },
+						{ "stats", no_argument, NULL, OPT_STATS },
 						{ 0, 0, 0, 0 } };
 
+	/* A replay brings the board it was recorded on, which has to be known
+	 * before the rest of the options are parsed against it
+	 */
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "edw:b:ic:s:h", long_options, &option_index)) != -1) {
+		if (c == OPT_REPLAY)
+			opt_replay = optarg;
+		else if (c == OPT_REPLAY_SPEED)
+			opt_replay_speed = atoi(optarg);
+	}
+	optind = 0;
+	opterr = 1;
+
+	if (opt_replay) {
+		if (opt_replay_speed <= 0) {
+			fprintf(stderr, "Replay speed must be a positive factor\n");
+			return 1;
+		}
+		if (micro_replay_load(opt_replay, opt_replay_speed, &replay_header) < 0) {
+			fprintf(stderr, "Failed to load recording %s: %s\n", opt_replay, strerror(errno));
+			return 1;
+		}
+		/* Nothing learned from a recording belongs in this boot's cache */
+		memset(&cache, 0, sizeof(cache));
+		board = find_board(&cache, replay_header.compatible);
+		if (board == NULL) {
+			printf("Unsupported platform \"%s\" in recording\n", replay_header.compatible);
+			return 1;
+		}
+		/* power_fail# edges are not recorded, the replayed status flags show it */
+		board->power_fail_bank = NULL;
+		micro_set_transport(&micro_replay_transport);
+	} else {
+		micro_cache_load(MICRO_CACHE_PATH, &cache);
+		board = get_board(&cache);
+		if (board == NULL) {
+			printf("Unsupported platform\n");
+			return 1;
+		}
+		micro_cache_store(MICRO_CACHE_PATH, &cache);
+	}
+
+	if (argc < 2) {
+		usage(argv, board);
+		return 1;
+	}
+
 	while ((c = getopt_long(argc, argv, "edw:b:ic:s:h", long_options, &option_index)) != -1) {
 		switch (c) {
 		case 'e':
@@ -173,6 +442,168 @@ int main(int argc, char *argv[])
 		case 'h':
 			usage(argv, board);
 			return 0;
+		case OPT_CAPTURE:
+			daemon_opts.capture_hz = atoi(optarg);
+			if (daemon_opts.capture_hz <= 0 || daemon_opts.capture_hz > MICRO_CAPTURE_MAX_HZ) {
+				fprintf(stderr, "Capture rate must be between 1 and %d Hz\n", MICRO_CAPTURE_MAX_HZ);
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_CAPTURE_DIR:
+			daemon_opts.capture_dir = optarg;
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_CAPTURE_FORMAT:
+			if (strcmp(optarg, "csv") == 0) {
+				daemon_opts.capture_format = MICRO_CAPTURE_CSV;
+			} else if (strcmp(optarg, "bin") == 0) {
+				daemon_opts.capture_format = MICRO_CAPTURE_BIN;
+			} else {
+				fprintf(stderr, "Capture format must be csv or bin\n");
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_SHUTDOWN_BUDGET:
+			daemon_opts.shutdown_budget_ms = atoi(optarg);
+			if (daemon_opts.shutdown_budget_ms <= 0) {
+				fprintf(stderr, "Shutdown budget must be a positive number of ms\n");
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_SHUTDOWN:
+			daemon_opts.shutdown_strategy = micro_shutdown_parse(optarg);
+			if (daemon_opts.shutdown_strategy < 0) {
+				fprintf(stderr, "Unknown shutdown strategy \"%s\"\n", optarg);
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_SHUTDOWN_SLEEP:
+			daemon_opts.shutdown_sleep_s = atoi(optarg);
+			if (daemon_opts.shutdown_sleep_s <= 0 || daemon_opts.shutdown_sleep_s > MICRO_SLEEP_MAX_SECONDS) {
+				fprintf(stderr, "Shutdown sleep must be between 1 and %u seconds\n", MICRO_SLEEP_MAX_SECONDS);
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_SAMPLE_MIN_MS:
+			daemon_opts.sample_min_ms = atoi(optarg);
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_SAMPLE_MAX_MS:
+			daemon_opts.sample_max_ms = atoi(optarg);
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_METRICS:
+			daemon_opts.metrics_path = optarg;
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_FILTER:
+			daemon_opts.filter = micro_filter_parse(optarg);
+			if (daemon_opts.filter < 0) {
+				fprintf(stderr, "Filter must be none, median or ema\n");
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_FILTER_SAMPLES:
+			daemon_opts.filter_samples = atoi(optarg);
+			if (daemon_opts.filter_samples < 2 || daemon_opts.filter_samples > MICRO_FILTER_MAX_SAMPLES) {
+				fprintf(stderr, "Filter samples must be between 2 and %d\n", MICRO_FILTER_MAX_SAMPLES);
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_SUPERVISOR:
+			if (nsups == MICRO_DAEMON_MAX_SUPERVISORS) {
+				fprintf(stderr, "At most %d supervisors can be watched\n", MICRO_DAEMON_MAX_SUPERVISORS);
+				return 1;
+			}
+			if (parse_supervisor(optarg, board, &sup_boards[nsups], &sup_pcts[nsups]) < 0) {
+				fprintf(stderr, "Supervisor must be <bus>:<addr>[:<percent>[:<gpiochip>:<line>]]\n");
+				return 1;
+			}
+			nsups++;
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_WATCH:
+			opt_watch_hz = atoi(optarg);
+			if (opt_watch_hz <= 0 || opt_watch_hz > MICRO_WATCH_MAX_HZ) {
+				fprintf(stderr, "Watch rate must be between 1 and %d Hz\n", MICRO_WATCH_MAX_HZ);
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_WATCH_FORMAT:
+			if (strcmp(optarg, "csv") == 0) {
+				opt_watch_format = MICRO_WATCH_CSV;
+			} else if (strcmp(optarg, "jsonl") == 0) {
+				opt_watch_format = MICRO_WATCH_JSON;
+			} else if (strcmp(optarg, "bin") == 0) {
+				opt_watch_format = MICRO_WATCH_BIN;
+			} else {
+				fprintf(stderr, "Watch format must be csv, jsonl or bin\n");
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_WATCH_COUNT:
+			opt_watch_count = atoll(optarg);
+			if (opt_watch_count <= 0) {
+				fprintf(stderr, "Watch count must be a positive number of samples\n");
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_RT_PRIORITY:
+			daemon_opts.rt_priority = atoi(optarg);
+			if (daemon_opts.rt_priority < 1 || daemon_opts.rt_priority > 99) {
+				fprintf(stderr, "Real-time priority must be between 1 and 99\n");
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_RT_CPUS:
+			if (parse_cpus(optarg, &daemon_opts.rt_cpus) < 0) {
+				fprintf(stderr, "CPUs must be a list such as 0,2-3, of CPUs 0 to 63\n");
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_LOOP_BUDGET:
+			daemon_opts.loop_budget_us = atoi(optarg);
+			if (daemon_opts.loop_budget_us <= 0) {
+				fprintf(stderr, "Loop budget must be a positive number of us\n");
+				return 1;
+			}
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_LATENCY:
+			opt_latency = 1;
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_TRACE:
+			daemon_opts.trace_path = optarg;
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_TRACE_REPORT:
+			opt_trace_report = optarg;
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_RECORD:
+			opt_record = optarg;
+			break;
+		case OPT_REPLAY:
+		case OPT_REPLAY_SPEED:
+			/* Already loaded */
+			opt_nonsleep_opt = 1;
+			break;
+		case OPT_STATS:
+			opt_stats = 1;
+			break;
 		case '?':
 		default:
 			fprintf(stderr, "Unexpected argument \"%s\"\n", optarg);
@@ -181,6 +612,27 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (daemon_opts.sample_min_ms <= 0 || daemon_opts.sample_max_ms < daemon_opts.sample_min_ms) {
+		fprintf(stderr, "Sample intervals must be positive, with the minimum no larger than the maximum\n");
+		return 1;
+	}
+
+	if (daemon_opts.rt_cpus && !daemon_opts.rt_priority) {
+		fprintf(stderr, "--rt-cpus can only be used with --rt-priority\n");
+		return 1;
+	}
+
+	if (daemon_opts.shutdown_sleep_s && daemon_opts.shutdown_strategy != MICRO_SHUTDOWN_EMERGENCY_REBOOT &&
+	    daemon_opts.shutdown_strategy != MICRO_SHUTDOWN_EMERGENCY_POWEROFF) {
+		fprintf(stderr, "--shutdown-sleep can only be used with an emergency --shutdown\n");
+		return 1;
+	}
+
+	if (nsups > 1 && opt_daemon_pct == -1) {
+		fprintf(stderr, "--supervisor can only be used with --daemon\n");
+		return 1;
+	}
+
 	/* If we had to fall back to the generic_board struct, we need to only
 	 * allow opt_sleep to be processed. Any other flags/options are not
 	 * guaranteed to correctly run in this case.
@@ -193,22 +645,93 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	i2cfd = micro_init(board->i2c_bus, board->i2c_chip);
+	if (opt_record && opt_replay) {
+		fprintf(stderr, "--record and --replay cannot be used together\n");
+		return 1;
+	}
+
+	if (opt_record) {
+		if (micro_record_start(opt_record, board->compatible, &micro_i2c_transport) < 0) {
+			fprintf(stderr, "Failed to create recording %s: %s\n", opt_record, strerror(errno));
+			return 1;
+		}
+		micro_set_transport(&micro_record_transport);
+	}
 
-	if (opt_enable) {
-		micro_scaps_en(i2cfd, board, 1);
+	if (opt_replay) {
+		for (int i = 1; i < nsups; i++)
+			sup_boards[i].power_fail_bank = NULL;
+		daemon_opts.shutdown_strategy = MICRO_SHUTDOWN_NONE;
+		daemon_opts.replay = 1;
 	}
-	if (opt_disable) {
-		micro_scaps_en(i2cfd, board, 0);
+
+	micro_stats_enabled = opt_stats;
+
+	/* --info can be answered by a running daemon, everything else needs the bus */
+	if (opt_enable || opt_disable || opt_wait_pct != -1 || opt_daemon_pct != -1 || opt_current != -1 ||
+	    opt_sleep != -1 || opt_watch_hz)
+		dev = micro_open(board->i2c_bus, board->i2c_chip);
+
+	if (opt_enable || opt_disable) {
+		lockfd = micro_bus_lock(board->i2c_bus);
+		if (opt_enable) {
+			micro_scaps_en(dev, board, 1);
+		}
+		if (opt_disable) {
+			micro_scaps_en(dev, board, 0);
+		}
+		micro_bus_unlock(lockfd);
 	}
 	if (opt_wait_pct != -1) {
-		micro_scaps_block_pct(i2cfd, board, opt_wait_pct);
+		micro_filter_init(&wait_filter, daemon_opts.filter, daemon_opts.filter_samples);
+		micro_scaps_block_pct(dev, board, opt_wait_pct, &wait_filter);
 	}
 	if (opt_daemon_pct != -1) {
-		micro_scaps_monitor_daemon(i2cfd, board, opt_daemon_pct);
+		sups[0].dev = dev;
+		sups[0].board = board;
+		sups[0].reboot_pct = opt_daemon_pct;
+		for (int i = 1; i < nsups; i++) {
+			sups[i].dev = micro_open(sup_boards[i].i2c_bus, sup_boards[i].i2c_chip);
+			sups[i].board = &sup_boards[i];
+			sups[i].reboot_pct = sup_pcts[i] == -1 ? opt_daemon_pct : sup_pcts[i];
+		}
+		micro_scaps_monitor_daemon(sups, nsups, &daemon_opts);
 	}
 	if (opt_info) {
-		board->info_function(i2cfd, board);
+		/* Only go to the bus if there is no daemon already reading it */
+		if (opt_replay || micro_sock_query(MICRO_SOCK_PATH, MICRO_SOCK_CMD_INFO, &info, sizeof(info)) < 0) {
+			/* Another option may have opened the bus already */
+			if (dev == NULL)
+				dev = micro_open(board->i2c_bus, board->i2c_chip);
+			lockfd = micro_bus_lock(board->i2c_bus);
+			ret = micro_cache_read_info(&cache, dev, &info);
+			micro_bus_unlock(lockfd);
+			if (ret < 0)
+				return 1;
+			micro_cache_store(MICRO_CACHE_PATH, &cache);
+		}
+		board->info_function(board, &info, stdout);
+	}
+	if (opt_latency) {
+		if (micro_sock_query(MICRO_SOCK_PATH, MICRO_SOCK_CMD_LATENCY, &latency, sizeof(latency)) < 0) {
+			fprintf(stderr, "No daemon running\n");
+			return 1;
+		}
+		micro_latency_print(&latency, stdout);
+	}
+	if (opt_trace_report) {
+		if (micro_trace_report(opt_trace_report, stdout) < 0) {
+			fprintf(stderr, "Failed to read trace %s: %s\n", opt_trace_report, strerror(errno));
+			return 1;
+		}
+	}
+	if (opt_watch_hz) {
+		if (micro_watch(dev, board, opt_watch_hz, opt_watch_format, opt_watch_count, stdout, &watch_stats) < 0)
+			return 1;
+		fprintf(stderr, "%llu samples, %llu deadlines missed, %.1f us mean and %.1f us max late\n",
+			(unsigned long long)watch_stats.samples, (unsigned long long)watch_stats.missed,
+			watch_stats.samples ? watch_stats.late_total_ns / 1000.0 / watch_stats.samples : 0.0,
+			watch_stats.late_max_ns / 1000.0);
 	}
 	if (opt_current != -1) {
 		if (opt_current < board->min_current || opt_current > board->max_current) {
@@ -219,10 +742,25 @@ int main(int argc, char *argv[])
 		}
 
 		// Set max charging mA
-		micro_set_charge_current(i2cfd, board, (uint16_t)opt_current);
+		lockfd = micro_bus_lock(board->i2c_bus);
+		micro_set_charge_current(dev, board, (uint16_t)opt_current);
+		micro_bus_unlock(lockfd);
 	}
 	if (opt_sleep != -1) {
-		micro_sleep(i2cfd, board, opt_sleep);
+		lockfd = micro_bus_lock(board->i2c_bus);
+		micro_sleep(dev, board, opt_sleep);
+		micro_bus_unlock(lockfd);
+	}
+	if (opt_stats) {
+		/* Nothing else to do, so report on the daemon's bus traffic */
+		if (!opt_nonsleep_opt && opt_sleep == -1) {
+			if (micro_sock_query(MICRO_SOCK_PATH, MICRO_SOCK_CMD_STATS, &micro_stats,
+					     sizeof(micro_stats)) < 0) {
+				fprintf(stderr, "No daemon running with --stats\n");
+				return 1;
+			}
+		}
+		micro_stats_print(&micro_stats, stdout);
 	}
 
 	return 0;
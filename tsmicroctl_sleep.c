@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "micro.h"
+
+/* Late shutdown sleep
+ *
+ * Does only what tsmicroctl --sleep does with the generic_board: one open() of
+ * the bus and one I2C_RDWR carrying the register address and sleep command.
+ * There is no libgpiod, no getopt and no devicetree lookup, and the binary is
+ * normally linked statically so the dynamic loader has nothing to do. This
+ * keeps it usable at the very end of shutdown, when most of the system is
+ * already gone.
+ *
+ * Run by hand as "tsmicroctl-sleep <seconds>". systemd-shutdown runs it from
+ * system-shutdown/ with the final action instead; a reboot then sleeps for the
+ * TSMICROCTL_SHUTDOWN_SLEEP seconds set at build time, and anything else is
+ * left alone.
+ */
+#define SLEEP_I2C_DEV "/dev/i2c-0"
+#define SLEEP_I2C_CHIP 0x54
+
+#ifndef TSMICROCTL_SHUTDOWN_SLEEP
+#define TSMICROCTL_SHUTDOWN_SLEEP 0
+#endif
+
+int main(int argc, char *argv[])
+{
+	uint8_t buf[7];
+	struct i2c_msg msg = {
+		.addr = SLEEP_I2C_CHIP,
+		.flags = 0,
+		.len = sizeof(buf),
+		.buf = buf,
+	};
+	struct i2c_rdwr_ioctl_data packets = {
+		.msgs = &msg,
+		.nmsgs = 1,
+	};
+	unsigned long seconds;
+	char *end;
+	int fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <seconds>\n", argv[0]);
+		return 1;
+	}
+
+	seconds = strtoul(argv[1], &end, 10);
+	if (end == argv[1] || *end != '\0') {
+		/* Called by systemd-shutdown with halt, poweroff, reboot or kexec */
+		if (strcmp(argv[1], "reboot") != 0 || TSMICROCTL_SHUTDOWN_SLEEP == 0)
+			return 0;
+		seconds = TSMICROCTL_SHUTDOWN_SLEEP;
+	}
+
+	if (seconds > MICRO_SLEEP_MAX_SECONDS) {
+		fprintf(stderr, "Error: Invalid sleep duration. Please specify between 0 and %u seconds.\n",
+			MICRO_SLEEP_MAX_SECONDS);
+		return 1;
+	}
+
+	buf[0] = MICRO_CMD >> 8;
+	buf[1] = MICRO_CMD & 0xff;
+	micro_sleep_cmd(&buf[2], seconds);
+
+	fd = open(SLEEP_I2C_DEV, O_RDWR);
+	if (fd == -1) {
+		perror("Couldn't open i2c device");
+		return 1;
+	}
+
+	if (ioctl(fd, I2C_RDWR, &packets) < 0) {
+		perror("Failed to write sleep command to microcontroller");
+		return 1;
+	}
+
+	return 0;
+}